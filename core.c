@@ -1159,7 +1159,7 @@ int nvme_get_features(struct nvme_ctrl *dev, unsigned fid, unsigned nsid,
 	return ret;
 }
 
-static int nvme_set_features(struct nvme_ctrl *dev, unsigned fid, unsigned dword11,
+int nvme_set_features(struct nvme_ctrl *dev, unsigned fid, unsigned dword11,
                       void *buffer, size_t buflen, u32 *result)
 {
 	struct nvme_command c;
@@ -1177,6 +1177,7 @@ static int nvme_set_features(struct nvme_ctrl *dev, unsigned fid, unsigned dword
 		*result = le32_to_cpu(res.u32);
 	return ret;
 }
+EXPORT_SYMBOL_GPL(nvme_set_features);
 
 int nvme_set_queue_count(struct nvme_ctrl *ctrl, int *count)
 {
@@ -1829,6 +1830,7 @@ static void __nvme_revalidate_disk(struct gendisk *disk, struct nvme_id_ns *id)
 {
 	struct nvme_ns *ns = disk->private_data;
 	struct nvme_ctrl *ctrl = ns->ctrl;
+	bool unsupported_ms = false;
 	u16 bs;
 
 	/*For device to shared,  Bit 0 is set nmic.
@@ -1846,14 +1848,25 @@ static void __nvme_revalidate_disk(struct gendisk *disk, struct nvme_id_ns *id)
 
 	blk_mq_freeze_queue(disk->queue);
 
-	if (ctrl->ops->flags & NVME_F_METADATA_SUPPORTED)
+	if (ctrl->ops->flags & NVME_F_METADATA_SUPPORTED) {
 		nvme_prep_integrity(disk, id, bs);
+	} else if (ctrl->pi_offload) {
+		/*
+		 * The transport can only insert and strip PI interleaved with
+		 * the data, any other metadata format stays unusable.
+		 */
+		nvme_prep_integrity(disk, id, bs);
+		unsupported_ms = ns->ms && !(ns->ext &&
+				ns->ms == sizeof(struct t10_pi_tuple) &&
+				ns->pi_type);
+	}
 	blk_queue_logical_block_size(ns->queue, bs);
 	if (ns->noiob)
 		nvme_set_chunk_size(ns);
-	if (ns->ms && !blk_get_integrity(disk) && !ns->ext)
+	if (ns->ms && !blk_get_integrity(disk) && !ns->ext && !unsupported_ms)
 		nvme_init_integrity(ns);
-	if (ns->ms && !(ns->ms == 8 && ns->pi_type) && !blk_get_integrity(disk))
+	if (unsupported_ms ||
+	    (ns->ms && !(ns->ms == 8 && ns->pi_type) && !blk_get_integrity(disk)))
 		set_capacity(disk, 0);
 	else
 		set_capacity(disk, le64_to_cpup(&id->nsze) << (ns->lba_shift - 9));
@@ -2085,7 +2098,8 @@ int nvme_enable_ctrl(struct nvme_ctrl *ctrl, u64 cap)
 
 	ctrl->ctrl_config = NVME_CC_CSS_NVM;
 	ctrl->ctrl_config |= (page_shift - 12) << NVME_CC_MPS_SHIFT;
-	ctrl->ctrl_config |= NVME_CC_AMS_RR | NVME_CC_SHN_NONE;
+	ctrl->ctrl_config |= ctrl->use_wrr ? NVME_CC_AMS_WRRU : NVME_CC_AMS_RR;
+	ctrl->ctrl_config |= NVME_CC_SHN_NONE;
 	ctrl->ctrl_config |= NVME_CC_IOSQES | NVME_CC_IOCQES;
 	ctrl->ctrl_config |= NVME_CC_ENABLE;
 
@@ -2136,6 +2150,7 @@ static void nvme_set_queue_limits(struct nvme_ctrl *ctrl,
 		u32 max_segments =
 			(ctrl->max_hw_sectors / (ctrl->page_size >> 9)) + 1;
 
+		max_segments = min_not_zero(max_segments, ctrl->max_segments);
 		blk_queue_max_hw_sectors(q, ctrl->max_hw_sectors);
 		blk_queue_max_segments(q, min_t(u32, max_segments, USHRT_MAX));
 	}
@@ -3955,9 +3970,16 @@ int nvme_init_ctrl(struct nvme_ctrl *ctrl, struct device *dev,
 	nvme_dev = MKDEV(nvme_char_major, ctrl->instance);
 	nvme_char_major = MAJOR(nvme_dev);
 
+	/*
+	 * Create the transport's attributes with the device, so that they
+	 * are there by the time udev hears about it.
+	 */
+	ctrl->device_groups[0] = &nvme_dev_attrs_group;
+	ctrl->device_groups[1] = ops->dev_attr_group;
+	ctrl->device_groups[2] = NULL;
 	ctrl->device = device_create_with_groups(nvme_class, ctrl->dev,
 				MKDEV(nvme_char_major, ctrl->instance),
-				ctrl, nvme_dev_attr_groups,
+				ctrl, ctrl->device_groups,
 				"nvme%d", ctrl->instance);
 
 	if (IS_ERR(ctrl->device)) {
@@ -432,6 +432,11 @@ EXPORT_SYMBOL_GPL(nvmf_connect_admin_queue);
  * between the host system device and the allocated NVMe controller
  * on the target system.
  *
+ * Transports may establish more I/O queues than hardware contexts (e.g.
+ * dedicated write queues).  The Connect for such a queue is issued on
+ * the hardware context the queue is paired with, and the transport picks
+ * the target queue from the qid carried in the command.
+ *
  * Return:
  *	0: success
  *	> 0: NVMe error status code
@@ -442,8 +447,12 @@ int nvmf_connect_io_queue(struct nvme_ctrl *ctrl, u16 qid)
 	struct nvme_command cmd;
 	struct nvmf_connect_data *data;
 	union nvme_result res;
+	u16 hctx_qid = qid;
 	int ret;
 
+	if (ctrl->tagset && qid > ctrl->tagset->nr_hw_queues)
+		hctx_qid = (qid - 1) % ctrl->tagset->nr_hw_queues + 1;
+
 	memset(&cmd, 0, sizeof(cmd));
 	cmd.connect.opcode = nvme_fabrics_command;
 	cmd.connect.fctype = nvme_fabrics_type_connect;
@@ -460,7 +469,7 @@ int nvmf_connect_io_queue(struct nvme_ctrl *ctrl, u16 qid)
 	strncpy(data->hostnqn, ctrl->opts->host->nqn, NVMF_NQN_SIZE);
 
 	ret = __nvme_submit_sync_cmd(ctrl->connect_q, &cmd, &res,
-			data, sizeof(*data), 0, qid, 1,
+			data, sizeof(*data), 0, hctx_qid, 1,
 			BLK_MQ_REQ_RESERVED | BLK_MQ_REQ_NOWAIT);
 	if (ret) {
 		nvmf_log_connect_error(ctrl, ret, le32_to_cpu(res.u32),
@@ -542,6 +551,7 @@ static const match_table_t opt_tokens = {
 	{ NVMF_OPT_NQN,			"nqn=%s"		},
 	{ NVMF_OPT_QUEUE_SIZE,		"queue_size=%d"		},
 	{ NVMF_OPT_NR_IO_QUEUES,	"nr_io_queues=%d"	},
+	{ NVMF_OPT_NR_WRITE_QUEUES,	"nr_write_queues=%d"	},
 	{ NVMF_OPT_RECONNECT_DELAY,	"reconnect_delay=%d"	},
 	{ NVMF_OPT_CTRL_LOSS_TMO,	"ctrl_loss_tmo=%d"	},
 	{ NVMF_OPT_KATO,		"keep_alive_tmo=%d"	},
@@ -649,6 +659,20 @@ static int nvmf_parse_options(struct nvmf_ctrl_options *opts,
 			opts->nr_io_queues = min_t(unsigned int,
 					num_online_cpus(), token);
 			break;
+		case NVMF_OPT_NR_WRITE_QUEUES:
+			if (match_int(args, &token)) {
+				ret = -EINVAL;
+				goto out;
+			}
+			if (token < 0) {
+				pr_err("Invalid number of write IOQs %d\n",
+					token);
+				ret = -EINVAL;
+				goto out;
+			}
+			opts->nr_write_queues = min_t(unsigned int,
+					num_online_cpus(), token);
+			break;
 		case NVMF_OPT_KATO:
 			if (match_int(args, &token)) {
 				ret = -EINVAL;
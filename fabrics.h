@@ -57,6 +57,7 @@ enum {
 	NVMF_OPT_HOST_TRADDR	= 1 << 10,
 	NVMF_OPT_CTRL_LOSS_TMO	= 1 << 11,
 	NVMF_OPT_HOST_ID	= 1 << 12,
+	NVMF_OPT_NR_WRITE_QUEUES = 1 << 13,
 };
 
 /**
@@ -77,6 +78,9 @@ enum {
  *              to use for the connection to the controller.
  * @queue_size: Number of IO queue elements.
  * @nr_io_queues: Number of controller IO queues that will be established.
+ * @nr_write_queues: Number of additional IO queues dedicated to writes, so
+ *		that reads don't queue up behind large writes.  Zero means
+ *		reads and writes share the @nr_io_queues queues.
  * @reconnect_delay: Time between two consecutive reconnect attempts.
  * @discovery_nqn: indicates if the subsysnqn is the well-known discovery NQN.
  * @kato:	Keep-alive timeout.
@@ -94,6 +98,7 @@ struct nvmf_ctrl_options {
 	char			*host_traddr;
 	size_t			queue_size;
 	unsigned int		nr_io_queues;
+	unsigned int		nr_write_queues;
 	unsigned int		reconnect_delay;
 	bool			discovery_nqn;
 	unsigned int		kato;
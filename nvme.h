@@ -139,6 +139,7 @@ struct nvme_ctrl {
 	struct list_head namespaces;
 	struct mutex namespaces_mutex;
 	struct device *device;	/* char device */
+	const struct attribute_group *device_groups[3];
 	struct list_head node;
 	struct ida ns_ida;
 	struct work_struct reset_work;
@@ -153,12 +154,14 @@ struct nvme_ctrl {
 	u16 cntlid;
 
 	u32 ctrl_config;
+	bool use_wrr;		/* weighted round robin with urgent arbitration */
 	u16 mtfa;
 	u32 queue_count;
 
 	u64 cap;
 	u32 page_size;
 	u32 max_hw_sectors;
+	u32 max_segments;
 	u16 oncs;
 	u16 vid;
 	u16 oacs;
@@ -195,6 +198,7 @@ struct nvme_ctrl {
 	u16 icdoff;
 	u16 maxcmd;
 	int nr_reconnects;
+	bool pi_offload;	/* transport inserts/strips PI on the wire */
 	struct nvmf_ctrl_options *opts;
 	struct kmem_cache *mpath_req_slab;
 	char mpath_req_cache_name[16];
@@ -268,6 +272,8 @@ struct nvme_ctrl_ops {
 	void (*submit_async_event)(struct nvme_ctrl *ctrl, int aer_idx);
 	int (*delete_ctrl)(struct nvme_ctrl *ctrl);
 	int (*get_address)(struct nvme_ctrl *ctrl, char *buf, int size);
+	/* transport attributes, created along with the char device */
+	const struct attribute_group *dev_attr_group;
 };
 
 static inline bool nvme_ctrl_ready(struct nvme_ctrl *ctrl)
@@ -365,6 +371,8 @@ int __nvme_submit_user_cmd(struct request_queue *q, struct nvme_command *cmd,
 		void __user *ubuffer, unsigned bufflen,
 		void __user *meta_buffer, unsigned meta_len, u32 meta_seed,
 		u32 *result, unsigned timeout);
+int nvme_set_features(struct nvme_ctrl *dev, unsigned fid, unsigned dword11,
+		void *buffer, size_t buflen, u32 *result);
 int nvme_set_queue_count(struct nvme_ctrl *ctrl, int *count);
 void nvme_start_keep_alive(struct nvme_ctrl *ctrl);
 void nvme_stop_keep_alive(struct nvme_ctrl *ctrl);
@@ -17,27 +17,73 @@
 #include <linux/blkdev.h>
 #include <linux/blk-mq.h>
 #include <linux/blk-mq-pci.h>
+#include <linux/debugfs.h>
 #include <linux/dmi.h>
+#include <linux/genalloc.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
+#include <linux/ioprio.h>
+#include <linux/mempool.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/pci.h>
 #include <linux/poison.h>
+#include <linux/prefetch.h>
 #include <linux/t10-pi.h>
 #include <linux/timer.h>
 #include <linux/types.h>
 #include <linux/io-64-nonatomic-lo-hi.h>
 #include <asm/unaligned.h>
 #include <linux/sed-opal.h>
+#include <linux/seq_file.h>
 
 #include "nvme.h"
 
 #define SQ_SIZE(depth)		(depth * sizeof(struct nvme_command))
 #define CQ_SIZE(depth)		(depth * sizeof(struct nvme_completion))
 
+#define SGES_PER_PAGE	(PAGE_SIZE / sizeof(struct nvme_sgl_desc))
+
+/*
+ * Limit the I/O size and segment count so the scatterlist and list
+ * pointers of the largest request fit an allocation we can keep in
+ * reserve in the iod mempool.
+ */
+#define NVME_MAX_KB_SZ	4096
+#define NVME_MAX_SEGS	127
+
+/*
+ * Number of PRP/SGL list allocations kept per CPU and pool, and how many
+ * we grab from the dma_pool at once when a cache runs dry.
+ */
+#define NVME_PRP_CACHE_SIZE	16
+#define NVME_PRP_CACHE_BATCH	8
+
+/* CQEs reaped before we ring the CQ doorbell and complete their requests */
+#define NVME_CQ_BATCH		16
+
+#define NVME_CAP_AMS_WRRU(cap)	(((cap) >> 17) & 0x1)
+#define NVME_WRR_BURST		3	/* arbitration burst of 2^3 commands */
+
+/*
+ * Submission queues added to each I/O queue with weighted round robin
+ * arbitration.  They complete on the CQ of their queue, whose own SQ
+ * takes medium priority I/O.
+ */
+enum {
+	NVME_PRIO_SQ_URGENT,
+	NVME_PRIO_SQ_HIGH,
+	NVME_PRIO_SQ_LOW,
+	NVME_NR_PRIO_SQS,
+};
+
+#define NVME_COALESCE_PERIOD	(HZ / 10)
+#define NVME_COALESCE_MAX_AGGR	32
+#define NVME_COALESCE_TIME	1	/* in 100us units */
+#define NVME_IV_CD		(1 << 16)	/* coalescing disable */
+
 /*
  * We handle AEN commands ourselves and don't even let the
  * block layer know about them.
@@ -51,10 +97,49 @@ static bool use_cmb_sqes = true;
 module_param(use_cmb_sqes, bool, 0644);
 MODULE_PARM_DESC(use_cmb_sqes, "use controller's memory buffer for I/O SQes");
 
+static bool use_cmb_lists;
+module_param(use_cmb_lists, bool, 0444);
+MODULE_PARM_DESC(use_cmb_lists,
+	"use controller's memory buffer for PRP and SGL lists");
+
+static unsigned int cmb_write_size;
+module_param(cmb_write_size, uint, 0444);
+MODULE_PARM_DESC(cmb_write_size,
+	"copy writes up to this size into the controller's memory buffer "
+	"(0 = disabled, at most one page)");
+
 static unsigned int max_host_mem_size_mb = 128;
 module_param(max_host_mem_size_mb, uint, 0444);
 MODULE_PARM_DESC(max_host_mem_size_mb,
-	"Maximum Host Memory Buffer (HMB) size per controller (in MiB)");
+	"Default maximum Host Memory Buffer (HMB) size per controller (in MiB), "
+	"adjustable per controller through the hmb_size_mb attribute");
+
+static unsigned int sgl_threshold = SZ_32K;
+module_param(sgl_threshold, uint, 0644);
+MODULE_PARM_DESC(sgl_threshold,
+		"Use SGLs when average request segment size is larger or equal to "
+		"this size. Use 0 to disable SGLs.");
+
+static unsigned int irq_coalesce_rate;
+module_param(irq_coalesce_rate, uint, 0444);
+MODULE_PARM_DESC(irq_coalesce_rate,
+	"Coalesce interrupts on vectors completing more than this many "
+	"commands per second with more than one command in flight. "
+	"Use 0 to disable coalescing.");
+
+static bool use_wrr;
+module_param(use_wrr, bool, 0444);
+MODULE_PARM_DESC(use_wrr,
+	"use weighted round robin arbitration and submission queues per "
+	"I/O priority class, if the controller supports it. The classes "
+	"still share the queue's tags, so lower priority I/O that uses "
+	"them all also holds up real-time I/O");
+
+static unsigned int wrr_weights[3] = { 16, 4, 1 };
+module_param_array(wrr_weights, uint, NULL, 0444);
+MODULE_PARM_DESC(wrr_weights,
+	"weighted round robin weights of the high, medium and low priority "
+	"queues (1-256)");
 
 static int io_queue_depth_set(const char *val, const struct kernel_param *kp);
 static const struct kernel_param_ops io_queue_depth_ops = {
@@ -69,6 +154,18 @@ MODULE_PARM_DESC(io_queue_depth, "set io queue depth, should >= 2");
 struct nvme_dev;
 struct nvme_queue;
 
+struct nvme_prp_cache {
+	unsigned int nr;
+	void *addr[NVME_PRP_CACHE_SIZE];
+	dma_addr_t dma[NVME_PRP_CACHE_SIZE];
+};
+
+/* Per-CPU front end to the PRP list pools, avoids the dma_pool lock */
+struct nvme_prp_caches {
+	struct nvme_prp_cache small;
+	struct nvme_prp_cache page;
+};
+
 static void nvme_process_cq(struct nvme_queue *nvmeq);
 static void nvme_dev_disable(struct nvme_dev *dev, bool shutdown);
 
@@ -83,22 +180,35 @@ struct nvme_dev {
 	struct device *dev;
 	struct dma_pool *prp_page_pool;
 	struct dma_pool *prp_small_pool;
+	struct nvme_prp_caches __percpu *prp_caches;
+	mempool_t *iod_mempool;
 	unsigned online_queues;
 	unsigned max_qid;
+	unsigned num_vecs;
 	int q_depth;
 	u32 db_stride;
 	void __iomem *bar;
 	unsigned long bar_mapped_size;
 	struct work_struct remove_work;
 	struct mutex shutdown_lock;
+	struct delayed_work coalesce_work;
+	u32 coalesce_cfg;
 	bool subsystem;
 	void __iomem *cmb;
 	dma_addr_t cmb_dma_addr;
 	u64 cmb_size;
 	u32 cmbsz;
 	u32 cmbloc;
+	/* end of the CMB for lists and write data, by bus address */
+	struct gen_pool *cmb_pool;
+	u64 cmb_pool_size;
+	bool cmb_lists;
+	bool cmb_wds;
+	bool prio_sqs;
 	struct nvme_ctrl ctrl;
 	struct completion ioq_wait;
+	struct completion ioq_create_wait;	/* Create CQ/SQ only */
+	struct dentry *debugfs_dir;
 
 	/* shadow doorbell buffer support: */
 	u32 *dbbuf_dbs;
@@ -108,6 +218,8 @@ struct nvme_dev {
 
 	/* host memory buffer support: */
 	u64 host_mem_size;
+	u64 host_mem_limit;
+	struct mutex host_mem_lock;
 	u32 nr_host_mem_descs;
 	struct nvme_host_mem_buf_desc *host_mem_descs;
 	void **host_mem_desc_bufs;
@@ -146,7 +258,7 @@ static inline struct nvme_dev *to_nvme_dev(struct nvme_ctrl *ctrl)
 struct nvme_queue {
 	struct device *q_dmadev;
 	struct nvme_dev *dev;
-	spinlock_t q_lock;
+	spinlock_t sq_lock;	/* protects sq_tail and last_sq_tail */
 	struct nvme_command *sq_cmds;
 	struct nvme_command __iomem *sq_cmds_io;
 	volatile struct nvme_completion *cqes;
@@ -157,10 +269,30 @@ struct nvme_queue {
 	u16 q_depth;
 	s16 cq_vector;
 	u16 sq_tail;
-	u16 cq_head;
+	u16 last_sq_tail;	/* tail last written to the doorbell */
 	u16 qid;
+	u16 cqid;		/* differs from qid for priority SQs */
+	u8 sq_prio;		/* NVME_SQ_PRIO_*, with WRR arbitration */
+	bool prio_sqs_live;
+	struct nvme_queue *prio_sqs[NVME_NR_PRIO_SQS];
+	unsigned long nr_sq_cmds;	/* commands copied into the SQ */
+	unsigned long nr_sq_dbs;	/* SQ tail doorbell writes */
+	/* completion side, kept apart from the submission side */
+	spinlock_t cq_lock ____cacheline_aligned_in_smp;
+	u16 cq_head;
 	u8 cq_phase;
 	u8 cqe_seen;
+	int create_status;
+	unsigned long nr_cqes;
+	/* interrupts that found completions, with irq_coalesce_rate set */
+	unsigned long nr_irqs;
+	unsigned long irq_depth;	/* commands in flight, summed over those */
+	unsigned long nr_lost_cmds;	/* never completed, cancelled by resets */
+	/* only used by the coalescing work */
+	unsigned long last_nr_cqes;
+	unsigned long last_nr_irqs;
+	unsigned long last_irq_depth;
+	bool coalesce_off;	/* for the first queue on each vector */
 	u32 *dbbuf_sq_db;
 	u32 *dbbuf_cq_db;
 	u32 *dbbuf_sq_ei;
@@ -179,7 +311,12 @@ struct nvme_iod {
 	int aborted;
 	int npages;		/* In the PRP list. 0 means small pool in use */
 	int nents;		/* Used in scatterlist */
+	u16 sqid;		/* SQ the command was submitted on */
+	bool use_sgl;		/* SGL descriptors instead of a PRP list */
 	int length;		/* Of data, in bytes */
+	unsigned int dma_len;	/* length of single DMA segment mapping */
+	unsigned int cmb_len;	/* length of the CMB allocation, if any */
+	dma_addr_t cmb_addr;
 	dma_addr_t first_dma;
 	struct scatterlist meta_sg; /* metadata requires single contiguous buffer */
 	struct scatterlist *sg;
@@ -329,17 +466,54 @@ static int nvme_npages(unsigned size, struct nvme_dev *dev)
 	return DIV_ROUND_UP(8 * nprps, PAGE_SIZE - 8);
 }
 
+/*
+ * Calculates the number of pages needed for the SGL segments. For example a 4k
+ * page can accommodate 256 SGL descriptors.
+ */
+static int nvme_npages_sgl(unsigned int num_seg)
+{
+	return DIV_ROUND_UP(num_seg * sizeof(struct nvme_sgl_desc), PAGE_SIZE);
+}
+
 static unsigned int nvme_iod_alloc_size(struct nvme_dev *dev,
-		unsigned int size, unsigned int nseg)
+		unsigned int size, unsigned int nseg, bool use_sgl)
+{
+	size_t alloc_size;
+
+	if (use_sgl)
+		alloc_size = sizeof(__le64 *) * nvme_npages_sgl(nseg);
+	else
+		alloc_size = sizeof(__le64 *) * nvme_npages(size, dev);
+
+	return alloc_size + sizeof(struct scatterlist) * nseg;
+}
+
+/*
+ * Size of the iod mempool elements.  This is needed before the controller
+ * is enabled, so it can't use nvme_npages(); the controller page size
+ * always ends up as PAGE_SIZE anyway.
+ */
+static unsigned int nvme_iod_max_alloc_size(void)
 {
-	return sizeof(__le64 *) * nvme_npages(size, dev) +
-			sizeof(struct scatterlist) * nseg;
+	unsigned nprps = DIV_ROUND_UP(NVME_MAX_KB_SZ * SZ_1K + PAGE_SIZE,
+				      PAGE_SIZE);
+	unsigned npages = max_t(unsigned,
+				DIV_ROUND_UP(8 * nprps, PAGE_SIZE - 8),
+				nvme_npages_sgl(NVME_MAX_SEGS));
+
+	return sizeof(__le64 *) * npages +
+		sizeof(struct scatterlist) * NVME_MAX_SEGS;
 }
 
 static unsigned int nvme_cmd_size(struct nvme_dev *dev)
 {
-	return sizeof(struct nvme_iod) +
-		nvme_iod_alloc_size(dev, NVME_INT_BYTES(dev), NVME_INT_PAGES);
+	unsigned int alloc_size = max(
+		nvme_iod_alloc_size(dev, NVME_INT_BYTES(dev), NVME_INT_PAGES,
+				    false),
+		nvme_iod_alloc_size(dev, NVME_INT_BYTES(dev), NVME_INT_PAGES,
+				    true));
+
+	return sizeof(struct nvme_iod) + alloc_size;
 }
 
 static int nvme_admin_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
@@ -391,22 +565,93 @@ static int nvme_init_request(struct blk_mq_tag_set *set, struct request *req,
 	return 0;
 }
 
+/*
+ * I/O queues beyond the number of interrupt vectors share vectors round
+ * robin, queue qid completing on vector (qid - 1) % num_vecs.
+ */
+static inline unsigned nvme_queue_vector(struct nvme_dev *dev, unsigned qid)
+{
+	return (qid - 1) % dev->num_vecs;
+}
+
+/*
+ * With more queues than vectors, spread the CPUs each vector is affine to
+ * over the queues that share it, so submitters stop contending on one SQ.
+ */
 static int nvme_pci_map_queues(struct blk_mq_tag_set *set)
 {
 	struct nvme_dev *dev = set->driver_data;
+	struct pci_dev *pdev = to_pci_dev(dev->dev);
+	const struct cpumask *mask;
+	unsigned int vec, cpu, nr;
+
+	if (set->nr_hw_queues <= dev->num_vecs)
+		return blk_mq_pci_map_queues(set, pdev);
+
+	for_each_possible_cpu(cpu)
+		set->mq_map[cpu] = 0;
+
+	for (vec = 0; vec < dev->num_vecs; vec++) {
+		mask = pci_irq_get_affinity(pdev, vec);
+		if (!mask)
+			return blk_mq_map_queues(set);
+
+		nr = 0;
+		for_each_cpu(cpu, mask) {
+			unsigned int queue = vec + nr * dev->num_vecs;
+
+			if (queue >= set->nr_hw_queues) {
+				nr = 0;
+				queue = vec;
+			}
+			set->mq_map[cpu] = queue;
+			nr++;
+		}
+	}
+	return 0;
+}
 
-	return blk_mq_pci_map_queues(set, to_pci_dev(dev->dev));
+/*
+ * Write the SQ tail doorbell for everything queued since the last write.
+ * The shadow doorbell event check compares against the previously written
+ * tail, so a batch of commands costs a single MMIO at most.
+ *
+ * Must be called with nvmeq->sq_lock held.
+ */
+static inline void nvme_write_sq_db(struct nvme_queue *nvmeq)
+{
+	if (nvme_dbbuf_update_and_check_event(nvmeq->sq_tail,
+			nvmeq->dbbuf_sq_db, nvmeq->dbbuf_sq_ei)) {
+		writel(nvmeq->sq_tail, nvmeq->q_db);
+		nvmeq->nr_sq_dbs++;
+	}
+	nvmeq->last_sq_tail = nvmeq->sq_tail;
+}
+
+/*
+ * Ring the doorbell if an earlier request of a batch left the tail
+ * unwritten.  blk-mq has no ->commit_rqs hook, so queue_rq does this
+ * itself whenever it fails a request: the failed one may have been the
+ * request expected to carry the batch's doorbell.
+ */
+static void nvme_kick_sq(struct nvme_queue *nvmeq)
+{
+	spin_lock(&nvmeq->sq_lock);
+	if (nvmeq->cq_vector >= 0 && nvmeq->sq_tail != nvmeq->last_sq_tail)
+		nvme_write_sq_db(nvmeq);
+	spin_unlock(&nvmeq->sq_lock);
 }
 
 /**
  * __nvme_submit_cmd() - Copy a command into a queue and ring the doorbell
  * @nvmeq: The queue to use
  * @cmd: The command to send
+ * @write_sq: whether to ring the doorbell now or leave it to a later command
  *
- * Safe to use from interrupt context
+ * Must be called with nvmeq->sq_lock held.
  */
 static void __nvme_submit_cmd(struct nvme_queue *nvmeq,
-						struct nvme_command *cmd)
+			      struct nvme_command *cmd, bool write_sq)
 {
 	u16 tail = nvmeq->sq_tail;
 
@@ -417,10 +662,10 @@ static void __nvme_submit_cmd(struct nvme_queue *nvmeq,
 
 	if (++tail == nvmeq->q_depth)
 		tail = 0;
-	if (nvme_dbbuf_update_and_check_event(tail, nvmeq->dbbuf_sq_db,
-					      nvmeq->dbbuf_sq_ei))
-		writel(tail, nvmeq->q_db);
 	nvmeq->sq_tail = tail;
+	nvmeq->nr_sq_cmds++;
+	if (write_sq)
+		nvme_write_sq_db(nvmeq);
 }
 
 static __le64 **iod_list(struct request *req)
@@ -429,14 +674,44 @@ static __le64 **iod_list(struct request *req)
 	return (__le64 **)(iod->sg + blk_rq_nr_phys_segments(req));
 }
 
+/*
+ * SGLs are only worth it when the segments are large enough that a single
+ * descriptor replaces a run of PRP entries.
+ */
+static bool nvme_use_sgls(struct nvme_dev *dev, struct request *req)
+{
+	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
+	int nseg = blk_rq_nr_phys_segments(req);
+	unsigned int avg_seg_size;
+
+	if (nseg == 0)
+		return false;
+
+	avg_seg_size = DIV_ROUND_UP(blk_rq_payload_bytes(req), nseg);
+
+	if (!(dev->ctrl.sgls & ((1 << 0) | (1 << 1))))
+		return false;
+	if (!iod->nvmeq->qid)
+		return false;
+	if (!sgl_threshold || avg_seg_size < sgl_threshold)
+		return false;
+	return true;
+}
+
 static blk_status_t nvme_init_iod(struct request *rq, struct nvme_dev *dev)
 {
 	struct nvme_iod *iod = blk_mq_rq_to_pdu(rq);
 	int nseg = blk_rq_nr_phys_segments(rq);
 	unsigned int size = blk_rq_payload_bytes(rq);
 
+	iod->use_sgl = nvme_use_sgls(dev, rq);
+
 	if (nseg > NVME_INT_PAGES || size > NVME_INT_BYTES(dev)) {
-		iod->sg = kmalloc(nvme_iod_alloc_size(dev, size, nseg), GFP_ATOMIC);
+		/*
+		 * Elements are sized for the largest request we allow, and the
+		 * reserve keeps large I/O going when GFP_ATOMIC fails.
+		 */
+		iod->sg = mempool_alloc(dev->iod_mempool, GFP_ATOMIC);
 		if (!iod->sg)
 			return BLK_STS_RESOURCE;
 	} else {
@@ -446,11 +721,98 @@ static blk_status_t nvme_init_iod(struct request *rq, struct nvme_dev *dev)
 	iod->aborted = 0;
 	iod->npages = -1;
 	iod->nents = 0;
+	iod->dma_len = 0;
+	iod->cmb_len = 0;
 	iod->length = size;
 
 	return BLK_STS_OK;
 }
 
+static struct nvme_prp_cache *nvme_prp_cache(struct nvme_dev *dev,
+		struct dma_pool *pool)
+{
+	struct nvme_prp_caches *caches = this_cpu_ptr(dev->prp_caches);
+
+	return pool == dev->prp_small_pool ? &caches->small : &caches->page;
+}
+
+static bool nvme_prp_cache_put(struct nvme_dev *dev, struct dma_pool *pool,
+		void *addr, dma_addr_t dma)
+{
+	struct nvme_prp_cache *cache;
+	unsigned long flags;
+	bool cached = false;
+
+	local_irq_save(flags);
+	cache = nvme_prp_cache(dev, pool);
+	if (cache->nr < NVME_PRP_CACHE_SIZE) {
+		cache->addr[cache->nr] = addr;
+		cache->dma[cache->nr] = dma;
+		cache->nr++;
+		cached = true;
+	}
+	local_irq_restore(flags);
+	return cached;
+}
+
+static void nvme_prp_free(struct nvme_dev *dev, struct dma_pool *pool,
+		void *addr, dma_addr_t dma)
+{
+	if (!nvme_prp_cache_put(dev, pool, addr, dma))
+		dma_pool_free(pool, addr, dma);
+}
+
+static void *nvme_prp_alloc(struct nvme_dev *dev, struct dma_pool *pool,
+		dma_addr_t *dma)
+{
+	struct nvme_prp_cache *cache;
+	unsigned long flags;
+	void *addr = NULL;
+	int i;
+
+	local_irq_save(flags);
+	cache = nvme_prp_cache(dev, pool);
+	if (cache->nr) {
+		cache->nr--;
+		addr = cache->addr[cache->nr];
+		*dma = cache->dma[cache->nr];
+	}
+	local_irq_restore(flags);
+	if (addr)
+		return addr;
+
+	/*
+	 * Refill with interrupts enabled, we may have moved to another CPU by
+	 * the time the entries are put back but that's harmless.
+	 */
+	addr = dma_pool_alloc(pool, GFP_ATOMIC, dma);
+	if (!addr)
+		return NULL;
+	for (i = 1; i < NVME_PRP_CACHE_BATCH; i++) {
+		dma_addr_t extra_dma;
+		void *extra = dma_pool_alloc(pool, GFP_ATOMIC, &extra_dma);
+
+		if (!extra)
+			break;
+		if (!nvme_prp_cache_put(dev, pool, extra, extra_dma)) {
+			dma_pool_free(pool, extra, extra_dma);
+			break;
+		}
+	}
+	return addr;
+}
+
+static void __iomem *nvme_cmb_alloc(struct nvme_dev *dev, size_t len,
+		dma_addr_t *addr)
+{
+	unsigned long bus = gen_pool_alloc(dev->cmb_pool, len);
+
+	if (!bus)
+		return NULL;
+	*addr = bus;
+	return dev->cmb + (bus - dev->cmb_dma_addr);
+}
+
 static void nvme_free_iod(struct nvme_dev *dev, struct request *req)
 {
 	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
@@ -459,30 +821,50 @@ static void nvme_free_iod(struct nvme_dev *dev, struct request *req)
 	__le64 **list = iod_list(req);
 	dma_addr_t prp_dma = iod->first_dma;
 
+	if (iod->cmb_len)
+		gen_pool_free(dev->cmb_pool, iod->cmb_addr, iod->cmb_len);
 	if (iod->npages == 0)
-		dma_pool_free(dev->prp_small_pool, list[0], prp_dma);
+		nvme_prp_free(dev, dev->prp_small_pool, list[0], prp_dma);
 	for (i = 0; i < iod->npages; i++) {
-		__le64 *prp_list = list[i];
-		dma_addr_t next_prp_dma = le64_to_cpu(prp_list[last_prp]);
-		dma_pool_free(dev->prp_page_pool, prp_list, prp_dma);
+		void *addr = list[i];
+		dma_addr_t next_prp_dma;
+
+		if (iod->use_sgl) {
+			struct nvme_sgl_desc *sg_list = addr;
+
+			next_prp_dma =
+				le64_to_cpu((sg_list[SGES_PER_PAGE - 1]).addr);
+		} else {
+			__le64 *prp_list = addr;
+
+			next_prp_dma = le64_to_cpu(prp_list[last_prp]);
+		}
+
+		nvme_prp_free(dev, dev->prp_page_pool, addr, prp_dma);
 		prp_dma = next_prp_dma;
 	}
 
 	if (iod->sg != iod->inline_sg)
-		kfree(iod->sg);
+		mempool_free(iod->sg, dev->iod_mempool);
 }
 
 #ifdef CONFIG_BLK_DEV_INTEGRITY
-static void nvme_dif_prep(u32 p, u32 v, struct t10_pi_tuple *pi)
+/*
+ * Remap a run of consecutive tuples.  The store is unconditional so the
+ * loop has no branches and no calls, untouched tags are written back
+ * as they were.
+ */
+static void nvme_dif_remap_run(struct t10_pi_tuple *pi, u32 n, u32 from,
+		u32 to)
 {
-	if (be32_to_cpu(pi->ref_tag) == v)
-		pi->ref_tag = cpu_to_be32(p);
-}
+	u32 i;
 
-static void nvme_dif_complete(u32 p, u32 v, struct t10_pi_tuple *pi)
-{
-	if (be32_to_cpu(pi->ref_tag) == p)
-		pi->ref_tag = cpu_to_be32(v);
+	for (i = 0; i < n; i++) {
+		__be32 ref = pi[i].ref_tag;
+
+		pi[i].ref_tag = be32_to_cpu(ref) == from + i ?
+				cpu_to_be32(to + i) : ref;
+	}
 }
 
 /**
@@ -493,48 +875,57 @@ static void nvme_dif_complete(u32 p, u32 v, struct t10_pi_tuple *pi)
  * start sector may be different. Remap protection information to match the
  * physical LBA on writes, and back to the original seed on reads.
  *
+ * Every bio of the request and every vector of its integrity payload is
+ * handled as one run of tuples.
+ *
  * Type 0 and 3 do not have a ref tag, so no remapping required.
  */
-static void nvme_dif_remap(struct request *req,
-			void (*dif_swap)(u32 p, u32 v, struct t10_pi_tuple *pi))
+static void nvme_dif_remap(struct request *req, bool prep)
 {
 	struct nvme_ns *ns = req->rq_disk->private_data;
-	struct bio_integrity_payload *bip;
-	struct t10_pi_tuple *pi;
-	void *p, *pmap;
-	u32 i, nlb, ts, phys, virt;
+	struct bio *bio;
 
 	if (!ns->pi_type || ns->pi_type == NVME_NS_DPS_PI_TYPE3)
 		return;
 
-	bip = bio_integrity(req->bio);
-	if (!bip)
-		return;
+	__rq_for_each_bio(bio, req) {
+		struct bio_integrity_payload *bip = bio_integrity(bio);
+		struct bvec_iter iter;
+		struct bio_vec bv;
+		u32 nlb, phys, virt;
 
-	pmap = kmap_atomic(bip->bip_vec->bv_page) + bip->bip_vec->bv_offset;
+		if (!bip)
+			continue;
 
-	p = pmap;
-	virt = bip_get_seed(bip);
-	phys = nvme_block_nr(ns, blk_rq_pos(req));
-	nlb = (blk_rq_bytes(req) >> ns->lba_shift);
-	ts = ns->disk->queue->integrity.tuple_size;
+		virt = bip_get_seed(bip);
+		phys = nvme_block_nr(ns, bio->bi_iter.bi_sector);
+		/* nothing to do if the seed already is the physical LBA */
+		if (virt == phys)
+			continue;
 
-	for (i = 0; i < nlb; i++, virt++, phys++) {
-		pi = (struct t10_pi_tuple *)p;
-		dif_swap(phys, virt, pi);
-		p += ts;
+		nlb = bio->bi_iter.bi_size >> ns->lba_shift;
+		bip_for_each_vec(bv, bip, iter) {
+			u32 n = min_t(u32, nlb,
+				      bv.bv_len / sizeof(struct t10_pi_tuple));
+			void *pmap = kmap_atomic(bv.bv_page);
+			struct t10_pi_tuple *pi = pmap + bv.bv_offset;
+
+			if (prep)
+				nvme_dif_remap_run(pi, n, virt, phys);
+			else
+				nvme_dif_remap_run(pi, n, phys, virt);
+			kunmap_atomic(pmap);
+
+			virt += n;
+			phys += n;
+			nlb -= n;
+			if (!nlb)
+				break;
+		}
 	}
-	kunmap_atomic(pmap);
 }
 #else /* CONFIG_BLK_DEV_INTEGRITY */
-static void nvme_dif_remap(struct request *req,
-			void (*dif_swap)(u32 p, u32 v, struct t10_pi_tuple *pi))
-{
-}
-static void nvme_dif_prep(u32 p, u32 v, struct t10_pi_tuple *pi)
-{
-}
-static void nvme_dif_complete(u32 p, u32 v, struct t10_pi_tuple *pi)
+static void nvme_dif_remap(struct request *req, bool prep)
 {
 }
 #endif
@@ -581,7 +972,7 @@ static blk_status_t nvme_setup_prps(struct nvme_dev *dev, struct request *req)
 		iod->npages = 1;
 	}
 
-	prp_list = dma_pool_alloc(pool, GFP_ATOMIC, &prp_dma);
+	prp_list = nvme_prp_alloc(dev, pool, &prp_dma);
 	if (!prp_list) {
 		iod->first_dma = dma_addr;
 		iod->npages = -1;
@@ -593,7 +984,7 @@ static blk_status_t nvme_setup_prps(struct nvme_dev *dev, struct request *req)
 	for (;;) {
 		if (i == page_size >> 3) {
 			__le64 *old_prp_list = prp_list;
-			prp_list = dma_pool_alloc(pool, GFP_ATOMIC, &prp_dma);
+			prp_list = nvme_prp_alloc(dev, pool, &prp_dma);
 			if (!prp_list)
 				return BLK_STS_RESOURCE;
 			list[iod->npages++] = prp_list;
@@ -634,6 +1025,212 @@ static blk_status_t nvme_setup_prps(struct nvme_dev *dev, struct request *req)
 
 }
 
+static void nvme_sgl_set_data(struct nvme_sgl_desc *sge,
+		struct scatterlist *sg)
+{
+	sge->addr = cpu_to_le64(sg_dma_address(sg));
+	sge->length = cpu_to_le32(sg_dma_len(sg));
+	sge->type = NVME_SGL_FMT_DATA_DESC << 4;
+}
+
+static void nvme_sgl_set_seg(struct nvme_sgl_desc *sge,
+		dma_addr_t dma_addr, int entries)
+{
+	sge->addr = cpu_to_le64(dma_addr);
+	if (entries < SGES_PER_PAGE) {
+		sge->length = cpu_to_le32(entries * sizeof(*sge));
+		sge->type = NVME_SGL_FMT_LAST_SEG_DESC << 4;
+	} else {
+		sge->length = cpu_to_le32(PAGE_SIZE);
+		sge->type = NVME_SGL_FMT_SEG_DESC << 4;
+	}
+}
+
+static blk_status_t nvme_setup_sgls(struct nvme_dev *dev,
+		struct request *req, struct nvme_rw_command *cmd, int entries)
+{
+	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
+	struct dma_pool *pool;
+	struct nvme_sgl_desc *sg_list;
+	struct scatterlist *sg = iod->sg;
+	__le64 **list = iod_list(req);
+	dma_addr_t sgl_dma;
+	int i = 0;
+
+	/* setting the transfer type as SGL */
+	cmd->flags = NVME_CMD_SGL_METABUF;
+
+	if (entries == 1) {
+		nvme_sgl_set_data(&cmd->dptr.sgl, sg);
+		return BLK_STS_OK;
+	}
+
+	if (entries <= (256 / sizeof(struct nvme_sgl_desc))) {
+		pool = dev->prp_small_pool;
+		iod->npages = 0;
+	} else {
+		pool = dev->prp_page_pool;
+		iod->npages = 1;
+	}
+
+	sg_list = nvme_prp_alloc(dev, pool, &sgl_dma);
+	if (!sg_list) {
+		iod->npages = -1;
+		return BLK_STS_RESOURCE;
+	}
+
+	list[0] = (__le64 *)sg_list;
+	iod->first_dma = sgl_dma;
+
+	nvme_sgl_set_seg(&cmd->dptr.sgl, sgl_dma, entries);
+
+	do {
+		if (i == SGES_PER_PAGE) {
+			struct nvme_sgl_desc *old_sg_desc = sg_list;
+			struct nvme_sgl_desc *link = &old_sg_desc[i - 1];
+
+			sg_list = nvme_prp_alloc(dev, pool, &sgl_dma);
+			if (!sg_list)
+				return BLK_STS_RESOURCE;
+
+			i = 0;
+			list[iod->npages++] = (__le64 *)sg_list;
+			sg_list[i++] = *link;
+			nvme_sgl_set_seg(link, sgl_dma, entries);
+		}
+
+		nvme_sgl_set_data(&sg_list[i++], sg);
+		sg = sg_next(sg);
+	} while (--entries > 0);
+
+	return BLK_STS_OK;
+}
+
+static inline struct bio_vec nvme_req_bvec(struct request *req)
+{
+	if (req->rq_flags & RQF_SPECIAL_PAYLOAD)
+		return req->special_vec;
+	return bio_iovec(req->bio);
+}
+
+/*
+ * A request that is a single bvec spanning at most two controller pages can
+ * be described by PRP1 and PRP2 alone, so map the bvec directly instead of
+ * going through a scatterlist.
+ */
+static bool nvme_can_map_simple(struct nvme_dev *dev, struct request *req,
+		struct bio_vec *bv)
+{
+	u32 page_size = dev->ctrl.page_size;
+
+	if (blk_rq_nr_phys_segments(req) != 1 || blk_integrity_rq(req))
+		return false;
+
+	*bv = nvme_req_bvec(req);
+	return bv->bv_len == blk_rq_payload_bytes(req) &&
+		(bv->bv_offset & (page_size - 1)) + bv->bv_len <=
+			page_size * 2;
+}
+
+static blk_status_t nvme_setup_prp_simple(struct nvme_dev *dev,
+		struct request *req, struct nvme_rw_command *cmnd,
+		struct bio_vec *bv)
+{
+	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
+	unsigned int offset = bv->bv_offset & (dev->ctrl.page_size - 1);
+	unsigned int first_prp_len = dev->ctrl.page_size - offset;
+	enum dma_data_direction dma_dir = rq_data_dir(req) ?
+			DMA_TO_DEVICE : DMA_FROM_DEVICE;
+
+	iod->first_dma = dma_map_page(dev->dev, bv->bv_page, bv->bv_offset,
+			bv->bv_len, dma_dir);
+	if (dma_mapping_error(dev->dev, iod->first_dma))
+		return BLK_STS_RESOURCE;
+	iod->dma_len = bv->bv_len;
+
+	cmnd->dptr.prp1 = cpu_to_le64(iod->first_dma);
+	if (bv->bv_len > first_prp_len)
+		cmnd->dptr.prp2 = cpu_to_le64(iod->first_dma + first_prp_len);
+	return BLK_STS_OK;
+}
+
+/*
+ * Move a list that fits the small pool into the CMB, the controller then
+ * fetches it over its internal bus instead of with a DMA read.
+ */
+static void nvme_cmb_move_list(struct nvme_dev *dev, struct request *req,
+		struct nvme_rw_command *cmnd)
+{
+	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
+	__le64 **list = iod_list(req);
+	void __iomem *cmb_list;
+	dma_addr_t addr;
+
+	if (!dev->cmb_lists || iod->npages != 0)
+		return;
+
+	cmb_list = nvme_cmb_alloc(dev, 256, &addr);
+	if (!cmb_list)
+		return;
+
+	memcpy_toio(cmb_list, list[0], 256);
+	nvme_prp_free(dev, dev->prp_small_pool, list[0], iod->first_dma);
+	iod->npages = -1;
+	iod->cmb_addr = addr;
+	iod->cmb_len = 256;
+
+	if (iod->use_sgl)
+		cmnd->dptr.sgl.addr = cpu_to_le64(addr);
+	else
+		iod->first_dma = addr;
+}
+
+static bool nvme_can_copy_to_cmb(struct nvme_dev *dev, struct request *req)
+{
+	return dev->cmb_wds && rq_data_dir(req) == WRITE &&
+		!(req->rq_flags & RQF_SPECIAL_PAYLOAD) &&
+		!blk_integrity_rq(req) &&
+		blk_rq_payload_bytes(req) <=
+			min_t(u32, cmb_write_size, dev->ctrl.page_size);
+}
+
+/*
+ * Copy a small write payload into the CMB instead of mapping it for DMA.
+ * Falls back to the normal mapping if the CMB pool is exhausted.
+ */
+static bool nvme_copy_to_cmb(struct nvme_dev *dev, struct request *req,
+		struct nvme_rw_command *cmnd)
+{
+	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
+	unsigned int len = blk_rq_payload_bytes(req);
+	unsigned int first_prp_len;
+	struct req_iterator iter;
+	struct bio_vec bv;
+	void __iomem *data;
+	dma_addr_t addr;
+
+	data = nvme_cmb_alloc(dev, len, &addr);
+	if (!data)
+		return false;
+	iod->cmb_addr = addr;
+	iod->cmb_len = len;
+
+	rq_for_each_segment(bv, req, iter) {
+		void *p = kmap_atomic(bv.bv_page);
+
+		memcpy_toio(data, p + bv.bv_offset, bv.bv_len);
+		kunmap_atomic(p);
+		data += bv.bv_len;
+	}
+
+	first_prp_len = dev->ctrl.page_size -
+			(addr & (dev->ctrl.page_size - 1));
+	cmnd->dptr.prp1 = cpu_to_le64(addr);
+	if (len > first_prp_len)
+		cmnd->dptr.prp2 = cpu_to_le64(addr + first_prp_len);
+	return true;
+}
+
 static blk_status_t nvme_map_data(struct nvme_dev *dev, struct request *req,
 		struct nvme_command *cmnd)
 {
@@ -642,6 +1239,15 @@ static blk_status_t nvme_map_data(struct nvme_dev *dev, struct request *req,
 	enum dma_data_direction dma_dir = rq_data_dir(req) ?
 			DMA_TO_DEVICE : DMA_FROM_DEVICE;
 	blk_status_t ret = BLK_STS_IOERR;
+	struct bio_vec bv;
+	int nr_mapped;
+
+	if (nvme_can_copy_to_cmb(dev, req) &&
+	    nvme_copy_to_cmb(dev, req, &cmnd->rw))
+		return BLK_STS_OK;
+
+	if (nvme_can_map_simple(dev, req, &bv))
+		return nvme_setup_prp_simple(dev, req, &cmnd->rw, &bv);
 
 	sg_init_table(iod->sg, blk_rq_nr_phys_segments(req));
 	iod->nents = blk_rq_map_sg(q, req, iod->sg);
@@ -649,13 +1255,18 @@ static blk_status_t nvme_map_data(struct nvme_dev *dev, struct request *req,
 		goto out;
 
 	ret = BLK_STS_RESOURCE;
-	if (!dma_map_sg_attrs(dev->dev, iod->sg, iod->nents, dma_dir,
-				DMA_ATTR_NO_WARN))
+	nr_mapped = dma_map_sg_attrs(dev->dev, iod->sg, iod->nents, dma_dir,
+			DMA_ATTR_NO_WARN);
+	if (!nr_mapped)
 		goto out;
 
-	ret = nvme_setup_prps(dev, req);
+	if (iod->use_sgl)
+		ret = nvme_setup_sgls(dev, req, &cmnd->rw, nr_mapped);
+	else
+		ret = nvme_setup_prps(dev, req);
 	if (ret != BLK_STS_OK)
 		goto out_unmap;
+	nvme_cmb_move_list(dev, req, &cmnd->rw);
 
 	ret = BLK_STS_IOERR;
 	if (blk_integrity_rq(req)) {
@@ -667,14 +1278,16 @@ static blk_status_t nvme_map_data(struct nvme_dev *dev, struct request *req,
 			goto out_unmap;
 
 		if (rq_data_dir(req))
-			nvme_dif_remap(req, nvme_dif_prep);
+			nvme_dif_remap(req, true);
 
 		if (!dma_map_sg(dev->dev, &iod->meta_sg, 1, dma_dir))
 			goto out_unmap;
 	}
 
-	cmnd->rw.dptr.prp1 = cpu_to_le64(sg_dma_address(iod->sg));
-	cmnd->rw.dptr.prp2 = cpu_to_le64(iod->first_dma);
+	if (!iod->use_sgl) {
+		cmnd->rw.dptr.prp1 = cpu_to_le64(sg_dma_address(iod->sg));
+		cmnd->rw.dptr.prp2 = cpu_to_le64(iod->first_dma);
+	}
 	if (blk_integrity_rq(req))
 		cmnd->rw.metadata = cpu_to_le64(sg_dma_address(&iod->meta_sg));
 	return BLK_STS_OK;
@@ -691,11 +1304,13 @@ static void nvme_unmap_data(struct nvme_dev *dev, struct request *req)
 	enum dma_data_direction dma_dir = rq_data_dir(req) ?
 			DMA_TO_DEVICE : DMA_FROM_DEVICE;
 
-	if (iod->nents) {
+	if (iod->dma_len) {
+		dma_unmap_page(dev->dev, iod->first_dma, iod->dma_len, dma_dir);
+	} else if (iod->nents) {
 		dma_unmap_sg(dev->dev, iod->sg, iod->nents, dma_dir);
 		if (blk_integrity_rq(req)) {
 			if (!rq_data_dir(req))
-				nvme_dif_remap(req, nvme_dif_complete);
+				nvme_dif_remap(req, false);
 			dma_unmap_sg(dev->dev, &iod->meta_sg, 1, dma_dir);
 		}
 	}
@@ -704,6 +1319,39 @@ static void nvme_unmap_data(struct nvme_dev *dev, struct request *req)
 	nvme_free_iod(dev, req);
 }
 
+/*
+ * Pick the SQ for a request from its I/O priority class when the queue
+ * has priority SQs: RT is urgent, BE above the normal level high, IDLE
+ * low and everything else goes to the queue's own, medium priority SQ.
+ *
+ * The priority SQs share the hctx's tags with the medium one, and blk-mq
+ * hands out tags before the request reaches us, with no way for a bio to
+ * ask for a reserved tag.  So this only orders commands at the controller:
+ * once lower priority I/O holds every tag, RT I/O waits for a tag like
+ * everybody else.
+ */
+static struct nvme_queue *nvme_prio_sq(struct nvme_queue *nvmeq,
+		struct request *req)
+{
+	unsigned short ioprio = req_get_ioprio(req);
+
+	if (!nvmeq->prio_sqs_live)
+		return nvmeq;
+
+	switch (IOPRIO_PRIO_CLASS(ioprio)) {
+	case IOPRIO_CLASS_RT:
+		return nvmeq->prio_sqs[NVME_PRIO_SQ_URGENT];
+	case IOPRIO_CLASS_BE:
+		if (IOPRIO_PRIO_DATA(ioprio) < IOPRIO_NORM)
+			return nvmeq->prio_sqs[NVME_PRIO_SQ_HIGH];
+		return nvmeq;
+	case IOPRIO_CLASS_IDLE:
+		return nvmeq->prio_sqs[NVME_PRIO_SQ_LOW];
+	default:
+		return nvmeq;
+	}
+}
+
 /*
  * NOTE: ns is NULL when called on the admin queue.
  */
@@ -714,12 +1362,14 @@ static blk_status_t nvme_queue_rq(struct blk_mq_hw_ctx *hctx,
 	struct nvme_queue *nvmeq = hctx->driver_data;
 	struct nvme_dev *dev = nvmeq->dev;
 	struct request *req = bd->rq;
+	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
+	struct nvme_queue *sq = nvme_prio_sq(nvmeq, req);
 	struct nvme_command cmnd;
 	blk_status_t ret;
 
 	ret = nvme_setup_cmd(ns, req, &cmnd);
 	if (ret)
-		return ret;
+		goto out_kick_sq;
 
 	ret = nvme_init_iod(req, dev);
 	if (ret)
@@ -733,20 +1383,32 @@ static blk_status_t nvme_queue_rq(struct blk_mq_hw_ctx *hctx,
 
 	blk_mq_start_request(req);
 
-	spin_lock_irq(&nvmeq->q_lock);
+	/*
+	 * Completions are left to the interrupt handler or poller, reaping
+	 * them here would make submitters contend on the CQ lock.
+	 */
+	iod->sqid = sq->qid;
+	spin_lock(&sq->sq_lock);
 	if (unlikely(nvmeq->cq_vector < 0)) {
 		ret = BLK_STS_IOERR;
-		spin_unlock_irq(&nvmeq->q_lock);
+		spin_unlock(&sq->sq_lock);
 		goto out_cleanup_iod;
 	}
-	__nvme_submit_cmd(nvmeq, &cmnd);
-	nvme_process_cq(nvmeq);
-	spin_unlock_irq(&nvmeq->q_lock);
+	/*
+	 * Only the default SQ defers its doorbell, priority I/O is rung
+	 * right away and flushes the batch if it ends it.
+	 */
+	__nvme_submit_cmd(sq, &cmnd, bd->last || sq != nvmeq);
+	spin_unlock(&sq->sq_lock);
+	if (sq != nvmeq && bd->last)
+		nvme_kick_sq(nvmeq);
 	return BLK_STS_OK;
 out_cleanup_iod:
 	nvme_free_iod(dev, req);
 out_free_cmd:
 	nvme_cleanup_cmd(req);
+out_kick_sq:
+	nvme_kick_sq(nvmeq);
 	return ret;
 }
 
@@ -805,6 +1467,28 @@ static inline void nvme_handle_cqe(struct nvme_queue *nvmeq,
 	nvme_end_request(req, cqe->status, cqe->result);
 }
 
+/*
+ * Start pulling in the request a CQE completes while we collect the rest of
+ * the batch.  nvme_end_request() writes the nvme_request in the PDU.
+ */
+static inline void nvme_prefetch_cqe(struct nvme_queue *nvmeq,
+		struct nvme_completion *cqe)
+{
+	struct request *req;
+
+	if (unlikely(cqe->command_id >= nvmeq->q_depth))
+		return;
+	if (unlikely(nvmeq->qid == 0 &&
+			cqe->command_id >= NVME_AQ_BLKMQ_DEPTH))
+		return;
+
+	req = blk_mq_tag_to_rq(*nvmeq->tags, cqe->command_id);
+	if (likely(req)) {
+		prefetch(req);
+		prefetchw(blk_mq_rq_to_pdu(req));
+	}
+}
+
 static inline bool nvme_read_cqe(struct nvme_queue *nvmeq,
 		struct nvme_completion *cqe)
 {
@@ -820,31 +1504,81 @@ static inline bool nvme_read_cqe(struct nvme_queue *nvmeq,
 	return false;
 }
 
+/*
+ * Reap the CQ, must be called with cq_lock held.
+ *
+ * CQEs are copied out NVME_CQ_BATCH at a time so that their requests can be
+ * prefetched while the rest of the batch is read.  The slots are handed back
+ * to the controller with a single doorbell write once the CQ is empty; this
+ * can't overflow it, as there are always fewer commands outstanding than
+ * entries in the queue.
+ */
 static void nvme_process_cq(struct nvme_queue *nvmeq)
 {
-	struct nvme_completion cqe;
-	int consumed = 0;
+	struct nvme_completion cqes[NVME_CQ_BATCH];
+	int nr, i, consumed = 0;
 
-	while (nvme_read_cqe(nvmeq, &cqe)) {
-		nvme_handle_cqe(nvmeq, &cqe);
-		consumed++;
-	}
+	do {
+		for (nr = 0; nr < NVME_CQ_BATCH; nr++) {
+			if (!nvme_read_cqe(nvmeq, &cqes[nr]))
+				break;
+			nvme_prefetch_cqe(nvmeq, &cqes[nr]);
+		}
+		if (!nr)
+			break;
+
+		for (i = 0; i < nr; i++)
+			nvme_handle_cqe(nvmeq, &cqes[i]);
+		consumed += nr;
+	} while (nr == NVME_CQ_BATCH);
 
 	if (consumed) {
 		nvme_ring_cq_doorbell(nvmeq);
 		nvmeq->cqe_seen = 1;
+		nvmeq->nr_cqes += consumed;
+	}
+}
+
+/*
+ * Commands submitted to all SQs of this CQ, including the ones lost to
+ * controller resets.
+ */
+static unsigned long nvme_cq_submitted(struct nvme_queue *nvmeq)
+{
+	unsigned long cmds = READ_ONCE(nvmeq->nr_sq_cmds);
+	int i;
+
+	for (i = 0; i < NVME_NR_PRIO_SQS; i++) {
+		struct nvme_queue *sq = READ_ONCE(nvmeq->prio_sqs[i]);
+
+		if (sq)
+			cmds += READ_ONCE(sq->nr_sq_cmds);
 	}
+	return cmds;
 }
 
 static irqreturn_t nvme_irq(int irq, void *data)
 {
 	irqreturn_t result;
 	struct nvme_queue *nvmeq = data;
-	spin_lock(&nvmeq->q_lock);
+	unsigned long done;
+
+	spin_lock(&nvmeq->cq_lock);
+	done = nvmeq->nr_cqes;
 	nvme_process_cq(nvmeq);
+	/*
+	 * For the coalescing work: how deep the queue was when the interrupt
+	 * came in.  Only sampled when coalescing is on, as it reads the
+	 * submission side's cachelines.
+	 */
+	if (irq_coalesce_rate && nvmeq->nr_cqes != done) {
+		nvmeq->nr_irqs++;
+		nvmeq->irq_depth += nvme_cq_submitted(nvmeq) - done -
+				nvmeq->nr_lost_cmds;
+	}
 	result = nvmeq->cqe_seen ? IRQ_HANDLED : IRQ_NONE;
 	nvmeq->cqe_seen = 0;
-	spin_unlock(&nvmeq->q_lock);
+	spin_unlock(&nvmeq->cq_lock);
 	return result;
 }
 
@@ -864,7 +1598,7 @@ static int __nvme_poll(struct nvme_queue *nvmeq, unsigned int tag)
 	if (!nvme_cqe_valid(nvmeq, nvmeq->cq_head, nvmeq->cq_phase))
 		return 0;
 
-	spin_lock_irq(&nvmeq->q_lock);
+	spin_lock_irq(&nvmeq->cq_lock);
 	while (nvme_read_cqe(nvmeq, &cqe)) {
 		nvme_handle_cqe(nvmeq, &cqe);
 		consumed++;
@@ -875,9 +1609,11 @@ static int __nvme_poll(struct nvme_queue *nvmeq, unsigned int tag)
 		}
        }
 
-	if (consumed)
+	if (consumed) {
 		nvme_ring_cq_doorbell(nvmeq);
-	spin_unlock_irq(&nvmeq->q_lock);
+		nvmeq->nr_cqes += consumed;
+	}
+	spin_unlock_irq(&nvmeq->cq_lock);
 
 	return found;
 }
@@ -899,9 +1635,9 @@ static void nvme_pci_submit_async_event(struct nvme_ctrl *ctrl, int aer_idx)
 	c.common.opcode = nvme_admin_async_event;
 	c.common.command_id = NVME_AQ_BLKMQ_DEPTH + aer_idx;
 
-	spin_lock_irq(&nvmeq->q_lock);
-	__nvme_submit_cmd(nvmeq, &c);
-	spin_unlock_irq(&nvmeq->q_lock);
+	spin_lock(&nvmeq->sq_lock);
+	__nvme_submit_cmd(nvmeq, &c, true);
+	spin_unlock(&nvmeq->sq_lock);
 }
 
 static int adapter_delete_queue(struct nvme_dev *dev, u8 opcode, u16 id)
@@ -915,46 +1651,40 @@ static int adapter_delete_queue(struct nvme_dev *dev, u8 opcode, u16 id)
 	return nvme_submit_sync_cmd(dev->ctrl.admin_q, &c, NULL, 0);
 }
 
-static int adapter_alloc_cq(struct nvme_dev *dev, u16 qid,
-						struct nvme_queue *nvmeq)
+static void nvme_init_create_cq(struct nvme_command *c,
+		struct nvme_queue *nvmeq)
 {
-	struct nvme_command c;
 	int flags = NVME_QUEUE_PHYS_CONTIG | NVME_CQ_IRQ_ENABLED;
 
 	/*
 	 * Note: we (ab)use the fact the the prp fields survive if no data
 	 * is attached to the request.
 	 */
-	memset(&c, 0, sizeof(c));
-	c.create_cq.opcode = nvme_admin_create_cq;
-	c.create_cq.prp1 = cpu_to_le64(nvmeq->cq_dma_addr);
-	c.create_cq.cqid = cpu_to_le16(qid);
-	c.create_cq.qsize = cpu_to_le16(nvmeq->q_depth - 1);
-	c.create_cq.cq_flags = cpu_to_le16(flags);
-	c.create_cq.irq_vector = cpu_to_le16(nvmeq->cq_vector);
-
-	return nvme_submit_sync_cmd(dev->ctrl.admin_q, &c, NULL, 0);
+	memset(c, 0, sizeof(*c));
+	c->create_cq.opcode = nvme_admin_create_cq;
+	c->create_cq.prp1 = cpu_to_le64(nvmeq->cq_dma_addr);
+	c->create_cq.cqid = cpu_to_le16(nvmeq->qid);
+	c->create_cq.qsize = cpu_to_le16(nvmeq->q_depth - 1);
+	c->create_cq.cq_flags = cpu_to_le16(flags);
+	c->create_cq.irq_vector = cpu_to_le16(nvmeq->cq_vector);
 }
 
-static int adapter_alloc_sq(struct nvme_dev *dev, u16 qid,
-						struct nvme_queue *nvmeq)
+static void nvme_init_create_sq(struct nvme_command *c,
+		struct nvme_queue *nvmeq)
 {
-	struct nvme_command c;
-	int flags = NVME_QUEUE_PHYS_CONTIG;
+	int flags = NVME_QUEUE_PHYS_CONTIG | nvmeq->sq_prio;
 
 	/*
 	 * Note: we (ab)use the fact the the prp fields survive if no data
 	 * is attached to the request.
 	 */
-	memset(&c, 0, sizeof(c));
-	c.create_sq.opcode = nvme_admin_create_sq;
-	c.create_sq.prp1 = cpu_to_le64(nvmeq->sq_dma_addr);
-	c.create_sq.sqid = cpu_to_le16(qid);
-	c.create_sq.qsize = cpu_to_le16(nvmeq->q_depth - 1);
-	c.create_sq.sq_flags = cpu_to_le16(flags);
-	c.create_sq.cqid = cpu_to_le16(qid);
-
-	return nvme_submit_sync_cmd(dev->ctrl.admin_q, &c, NULL, 0);
+	memset(c, 0, sizeof(*c));
+	c->create_sq.opcode = nvme_admin_create_sq;
+	c->create_sq.prp1 = cpu_to_le64(nvmeq->sq_dma_addr);
+	c->create_sq.sqid = cpu_to_le16(nvmeq->qid);
+	c->create_sq.qsize = cpu_to_le16(nvmeq->q_depth - 1);
+	c->create_sq.sq_flags = cpu_to_le16(flags);
+	c->create_sq.cqid = cpu_to_le16(nvmeq->cqid);
 }
 
 static int adapter_delete_cq(struct nvme_dev *dev, u16 cqid)
@@ -1096,7 +1826,7 @@ static enum blk_eh_timer_return nvme_timeout(struct request *req, bool reserved)
 	memset(&cmd, 0, sizeof(cmd));
 	cmd.abort.opcode = nvme_admin_abort_cmd;
 	cmd.abort.cid = req->tag;
-	cmd.abort.sqid = cpu_to_le16(nvmeq->qid);
+	cmd.abort.sqid = cpu_to_le16(iod->sqid);
 
 	dev_warn(nvmeq->dev->ctrl.device,
 		"I/O %d QID %d timeout, aborting\n",
@@ -1123,6 +1853,17 @@ static enum blk_eh_timer_return nvme_timeout(struct request *req, bool reserved)
 
 static void nvme_free_queue(struct nvme_queue *nvmeq)
 {
+	int i;
+
+	for (i = 0; i < NVME_NR_PRIO_SQS; i++) {
+		struct nvme_queue *sq = nvmeq->prio_sqs[i];
+
+		if (!sq)
+			continue;
+		dma_free_coherent(sq->q_dmadev, SQ_SIZE(sq->q_depth),
+				sq->sq_cmds, sq->sq_dma_addr);
+		kfree(sq);
+	}
 	dma_free_coherent(nvmeq->q_dmadev, CQ_SIZE(nvmeq->q_depth),
 				(void *)nvmeq->cqes, nvmeq->cq_dma_addr);
 	if (nvmeq->sq_cmds)
@@ -1151,15 +1892,18 @@ static int nvme_suspend_queue(struct nvme_queue *nvmeq)
 {
 	int vector;
 
-	spin_lock_irq(&nvmeq->q_lock);
+	spin_lock_irq(&nvmeq->sq_lock);
+	spin_lock(&nvmeq->cq_lock);
 	if (nvmeq->cq_vector == -1) {
-		spin_unlock_irq(&nvmeq->q_lock);
+		spin_unlock(&nvmeq->cq_lock);
+		spin_unlock_irq(&nvmeq->sq_lock);
 		return 1;
 	}
 	vector = nvmeq->cq_vector;
 	nvmeq->dev->online_queues--;
 	nvmeq->cq_vector = -1;
-	spin_unlock_irq(&nvmeq->q_lock);
+	spin_unlock(&nvmeq->cq_lock);
+	spin_unlock_irq(&nvmeq->sq_lock);
 
 	if (!nvmeq->qid && nvmeq->dev->ctrl.admin_q)
 		blk_mq_quiesce_queue(nvmeq->dev->ctrl.admin_q);
@@ -1183,9 +1927,9 @@ static void nvme_disable_admin_queue(struct nvme_dev *dev, bool shutdown)
 	else
 		nvme_disable_ctrl(&dev->ctrl, dev->ctrl.cap);
 
-	spin_lock_irq(&nvmeq->q_lock);
+	spin_lock_irq(&nvmeq->cq_lock);
 	nvme_process_cq(nvmeq);
-	spin_unlock_irq(&nvmeq->q_lock);
+	spin_unlock_irq(&nvmeq->cq_lock);
 }
 
 static int nvme_cmb_qdepth(struct nvme_dev *dev, int nr_io_queues,
@@ -1248,12 +1992,26 @@ static struct nvme_queue *nvme_alloc_queue(struct nvme_dev *dev, int qid,
 
 	nvmeq->q_dmadev = dev->dev;
 	nvmeq->dev = dev;
-	spin_lock_init(&nvmeq->q_lock);
+	spin_lock_init(&nvmeq->sq_lock);
+	spin_lock_init(&nvmeq->cq_lock);
 	nvmeq->cq_head = 0;
 	nvmeq->cq_phase = 1;
+	nvmeq->nr_sq_cmds = 0;
+	nvmeq->nr_sq_dbs = 0;
+	nvmeq->nr_cqes = 0;
+	nvmeq->nr_irqs = 0;
+	nvmeq->irq_depth = 0;
+	nvmeq->nr_lost_cmds = 0;
+	nvmeq->last_nr_cqes = 0;
+	nvmeq->last_nr_irqs = 0;
+	nvmeq->last_irq_depth = 0;
+	nvmeq->coalesce_off = false;
 	nvmeq->q_db = &dev->dbs[qid * 2 * dev->db_stride];
 	nvmeq->q_depth = depth;
 	nvmeq->qid = qid;
+	nvmeq->cqid = qid;
+	if (qid && dev->ctrl.use_wrr)
+		nvmeq->sq_prio = NVME_SQ_PRIO_MEDIUM;
 	nvmeq->cq_vector = -1;
 	dev->queues[qid] = nvmeq;
 	dev->ctrl.queue_count++;
@@ -1286,43 +2044,125 @@ static void nvme_init_queue(struct nvme_queue *nvmeq, u16 qid)
 {
 	struct nvme_dev *dev = nvmeq->dev;
 
-	spin_lock_irq(&nvmeq->q_lock);
+	spin_lock_irq(&nvmeq->sq_lock);
+	spin_lock(&nvmeq->cq_lock);
 	nvmeq->sq_tail = 0;
+	nvmeq->last_sq_tail = 0;
+	nvmeq->prio_sqs_live = false;
 	nvmeq->cq_head = 0;
 	nvmeq->cq_phase = 1;
+	/* whatever was outstanding has been cancelled and won't complete */
+	nvmeq->nr_lost_cmds = nvme_cq_submitted(nvmeq) - nvmeq->nr_cqes;
 	nvmeq->q_db = &dev->dbs[qid * 2 * dev->db_stride];
 	memset((void *)nvmeq->cqes, 0, CQ_SIZE(nvmeq->q_depth));
 	nvme_dbbuf_init(dev, nvmeq, qid);
 	dev->online_queues++;
-	spin_unlock_irq(&nvmeq->q_lock);
+	spin_unlock(&nvmeq->cq_lock);
+	spin_unlock_irq(&nvmeq->sq_lock);
 }
 
-static int nvme_create_queue(struct nvme_queue *nvmeq, int qid)
+static void nvme_create_queue_end(struct request *req, blk_status_t error)
 {
-	struct nvme_dev *dev = nvmeq->dev;
-	int result;
+	struct nvme_queue *nvmeq = req->end_io_data;
 
-	nvmeq->cq_vector = qid - 1;
-	result = adapter_alloc_cq(dev, qid, nvmeq);
-	if (result < 0)
-		return result;
+	if (nvme_req(req)->flags & NVME_REQ_CANCELLED)
+		nvmeq->create_status = -EINTR;
+	else
+		nvmeq->create_status = nvme_req(req)->status;
 
-	result = adapter_alloc_sq(dev, qid, nvmeq);
-	if (result < 0)
-		goto release_cq;
+	blk_mq_free_request(req);
+	complete(&nvmeq->dev->ioq_create_wait);
+}
 
-	result = queue_request_irq(nvmeq);
-	if (result < 0)
-		goto release_sq;
+static int nvme_create_queue_async(struct nvme_queue *nvmeq, u8 opcode)
+{
+	struct request_queue *q = nvmeq->dev->ctrl.admin_q;
+	struct request *req;
+	struct nvme_command cmd;
 
-	nvme_init_queue(nvmeq, qid);
-	return result;
+	if (opcode == nvme_admin_create_cq)
+		nvme_init_create_cq(&cmd, nvmeq);
+	else
+		nvme_init_create_sq(&cmd, nvmeq);
 
- release_sq:
-	adapter_delete_sq(dev, qid);
- release_cq:
-	adapter_delete_cq(dev, qid);
-	return result;
+	req = nvme_alloc_request(q, &cmd, BLK_MQ_REQ_NOWAIT, NVME_QID_ANY);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	req->timeout = ADMIN_TIMEOUT;
+	req->end_io_data = nvmeq;
+
+	blk_execute_rq_nowait(q, NULL, req, false, nvme_create_queue_end);
+	return 0;
+}
+
+/*
+ * Wait for one of the Create commands in flight.  Once they have taken
+ * longer than ADMIN_TIMEOUT in total, returns false and the caller stops
+ * sending more; the ones in flight are still waited for.  The admin queue's
+ * timeout handler disables the controller, which cancels them, and their
+ * completions must not be left for a later wait to consume.
+ */
+static bool nvme_wait_create(struct nvme_dev *dev, unsigned long *timeout)
+{
+	if (*timeout)
+		*timeout = wait_for_completion_io_timeout(&dev->ioq_create_wait,
+				*timeout);
+	if (!*timeout)
+		wait_for_completion_io(&dev->ioq_create_wait);
+	return *timeout != 0;
+}
+
+/*
+ * Send Create CQ or Create SQ for queues first..last without waiting for
+ * each one, as many at a time as we get admin tags for.  Returns the last
+ * queue of the leading run that was created, anything created after a
+ * failure is deleted again so the online queues stay contiguous.
+ */
+static int nvme_create_queues(struct nvme_dev *dev, int first, int last,
+		u8 opcode)
+{
+	unsigned long timeout = ADMIN_TIMEOUT;
+	int i = first, sent = 0, created, status = 0;
+
+	reinit_completion(&dev->ioq_create_wait);
+	while (i <= last || sent) {
+		if (i <= last) {
+			if (!nvme_create_queue_async(dev->queues[i], opcode)) {
+				i++;
+				sent++;
+				continue;
+			}
+			/* nothing in flight to wait for, give up on the rest */
+			if (!sent) {
+				last = i - 1;
+				continue;
+			}
+		}
+		if (!nvme_wait_create(dev, &timeout))
+			last = i - 1;
+		sent--;
+	}
+	if (!timeout)
+		return -ETIMEDOUT;
+
+	for (created = first; created <= last; created++) {
+		status = dev->queues[created]->create_status;
+		if (status)
+			break;
+	}
+	for (i = created + 1; i <= last; i++) {
+		if (dev->queues[i]->create_status)
+			continue;
+		if (opcode == nvme_admin_create_cq)
+			adapter_delete_cq(dev, i);
+		else
+			adapter_delete_sq(dev, i);
+	}
+
+	if (status < 0)
+		return status;
+	return created - 1;
 }
 
 static const struct blk_mq_ops nvme_mq_admin_ops = {
@@ -1457,40 +2297,202 @@ static int nvme_pci_configure_admin_queue(struct nvme_dev *dev)
 	lo_hi_writeq(nvmeq->sq_dma_addr, dev->bar + NVME_REG_ASQ);
 	lo_hi_writeq(nvmeq->cq_dma_addr, dev->bar + NVME_REG_ACQ);
 
-	result = nvme_enable_ctrl(&dev->ctrl, dev->ctrl.cap);
-	if (result)
-		return result;
+	dev->ctrl.use_wrr = use_wrr && NVME_CAP_AMS_WRRU(dev->ctrl.cap);
+	result = nvme_enable_ctrl(&dev->ctrl, dev->ctrl.cap);
+	if (result)
+		return result;
+
+	nvmeq->cq_vector = 0;
+	result = queue_request_irq(nvmeq);
+	if (result) {
+		nvmeq->cq_vector = -1;
+		return result;
+	}
+
+	return result;
+}
+
+static inline u16 nvme_prio_sqid(struct nvme_dev *dev, int qid, int prio)
+{
+	return dev->max_qid + (qid - 1) * NVME_NR_PRIO_SQS + prio + 1;
+}
+
+static const u8 nvme_prio_sq_flags[NVME_NR_PRIO_SQS] = {
+	[NVME_PRIO_SQ_URGENT]	= NVME_SQ_PRIO_URGENT,
+	[NVME_PRIO_SQ_HIGH]	= NVME_SQ_PRIO_HIGH,
+	[NVME_PRIO_SQ_LOW]	= NVME_SQ_PRIO_LOW,
+};
+
+static int nvme_alloc_prio_sqs(struct nvme_dev *dev, struct nvme_queue *nvmeq)
+{
+	int i;
+
+	for (i = 0; i < NVME_NR_PRIO_SQS; i++) {
+		struct nvme_queue *sq;
+
+		if (nvmeq->prio_sqs[i])
+			continue;
+
+		sq = kzalloc_node(sizeof(*sq), GFP_KERNEL,
+				dev_to_node(dev->dev));
+		if (!sq)
+			return -ENOMEM;
+		sq->sq_cmds = dma_alloc_coherent(dev->dev,
+				SQ_SIZE(nvmeq->q_depth), &sq->sq_dma_addr,
+				GFP_KERNEL);
+		if (!sq->sq_cmds) {
+			kfree(sq);
+			return -ENOMEM;
+		}
+
+		sq->q_dmadev = dev->dev;
+		sq->dev = dev;
+		spin_lock_init(&sq->sq_lock);
+		sq->q_depth = nvmeq->q_depth;
+		sq->cq_vector = -1;
+		sq->sq_prio = nvme_prio_sq_flags[i];
+		nvmeq->prio_sqs[i] = sq;
+	}
+	return 0;
+}
+
+/*
+ * Create the priority SQs of queues first..last, pipelined like the
+ * queues themselves.  They are optional: a queue that doesn't get all of
+ * them keeps sending everything to its own SQ.
+ */
+static void nvme_create_prio_sqs(struct nvme_dev *dev, int first, int last)
+{
+	unsigned long timeout = ADMIN_TIMEOUT;
+	int qid, i, sent = 0;
+
+	/* only SQs whose Create SQ completes successfully count as created */
+	for (qid = first; qid <= last; qid++) {
+		struct nvme_queue *nvmeq = dev->queues[qid];
+
+		for (i = 0; i < NVME_NR_PRIO_SQS; i++)
+			if (nvmeq->prio_sqs[i])
+				nvmeq->prio_sqs[i]->create_status = -EAGAIN;
+	}
+
+	reinit_completion(&dev->ioq_create_wait);
+	for (qid = first; qid <= last; qid++) {
+		struct nvme_queue *nvmeq = dev->queues[qid];
+
+		if (nvme_alloc_prio_sqs(dev, nvmeq)) {
+			for (i = 0; i < NVME_NR_PRIO_SQS; i++)
+				if (nvmeq->prio_sqs[i])
+					nvmeq->prio_sqs[i]->create_status =
+						-ENOMEM;
+			continue;
+		}
 
-	nvmeq->cq_vector = 0;
-	result = queue_request_irq(nvmeq);
-	if (result) {
-		nvmeq->cq_vector = -1;
-		return result;
+		for (i = 0; i < NVME_NR_PRIO_SQS; i++) {
+			struct nvme_queue *sq = nvmeq->prio_sqs[i];
+
+			sq->qid = nvme_prio_sqid(dev, qid, i);
+			sq->cqid = qid;
+			sq->q_db = &dev->dbs[sq->qid * 2 * dev->db_stride];
+			sq->sq_tail = 0;
+			sq->last_sq_tail = 0;
+			sq->create_status = -EAGAIN;
+
+			while (nvme_create_queue_async(sq, nvme_admin_create_sq)) {
+				if (!sent)
+					goto wait;
+				sent--;
+				if (!nvme_wait_create(dev, &timeout))
+					goto wait;
+			}
+			sent++;
+		}
 	}
+ wait:
+	while (sent--)
+		nvme_wait_create(dev, &timeout);
+	if (!timeout)
+		return;
 
-	return result;
+	for (qid = first; qid <= last; qid++) {
+		struct nvme_queue *nvmeq = dev->queues[qid];
+		int created = 0;
+
+		for (i = 0; i < NVME_NR_PRIO_SQS; i++)
+			if (nvmeq->prio_sqs[i] && !nvmeq->prio_sqs[i]->create_status)
+				created |= 1 << i;
+		if (created == (1 << NVME_NR_PRIO_SQS) - 1) {
+			nvmeq->prio_sqs_live = true;
+			continue;
+		}
+
+		for (i = 0; i < NVME_NR_PRIO_SQS; i++)
+			if (created & (1 << i))
+				adapter_delete_sq(dev, nvmeq->prio_sqs[i]->qid);
+	}
 }
 
 static int nvme_create_io_queues(struct nvme_dev *dev)
 {
-	unsigned i, max;
+	int i, first, max, last_cq, last_sq;
 	int ret = 0;
 
 	for (i = dev->ctrl.queue_count; i <= dev->max_qid; i++) {
-		/* vector == qid - 1, match nvme_create_queue */
+		/* match the vector picked below */
 		if (!nvme_alloc_queue(dev, i, dev->q_depth,
-		     pci_irq_get_node(to_pci_dev(dev->dev), i - 1))) {
+		     pci_irq_get_node(to_pci_dev(dev->dev),
+				      nvme_queue_vector(dev, i)))) {
 			ret = -ENOMEM;
 			break;
 		}
 	}
 
-	max = min(dev->max_qid, dev->ctrl.queue_count - 1);
-	for (i = dev->online_queues; i <= max; i++) {
-		ret = nvme_create_queue(dev->queues[i], i);
+	/*
+	 * Pipeline the Create CQ and then the Create SQ commands for all
+	 * queues instead of waiting for two admin round trips per queue.
+	 */
+	first = dev->online_queues;
+	max = min_t(int, dev->max_qid, dev->ctrl.queue_count - 1);
+	if (first > max)
+		return 0;
+
+	for (i = first; i <= max; i++)
+		dev->queues[i]->cq_vector = nvme_queue_vector(dev, i);
+
+	/*
+	 * On errors the reset fails and the controller gets disabled, don't
+	 * bother deleting what was created.
+	 */
+	last_cq = nvme_create_queues(dev, first, max, nvme_admin_create_cq);
+	if (last_cq < 0) {
+		ret = last_cq;
+		last_sq = first - 1;
+		goto out_reset_vectors;
+	}
+	last_sq = nvme_create_queues(dev, first, last_cq, nvme_admin_create_sq);
+	if (last_sq < 0) {
+		ret = last_sq;
+		last_sq = first - 1;
+		goto out_reset_vectors;
+	}
+
+	for (i = first; i <= last_sq; i++) {
+		ret = queue_request_irq(dev->queues[i]);
 		if (ret)
 			break;
+		nvme_init_queue(dev->queues[i], i);
 	}
+	for (; i <= last_sq; i++)
+		adapter_delete_sq(dev, i);
+	last_sq = dev->online_queues - 1;
+
+	if (dev->prio_sqs)
+		nvme_create_prio_sqs(dev, first, last_sq);
+
+	for (i = last_sq + 1; i <= last_cq; i++)
+		adapter_delete_cq(dev, i);
+ out_reset_vectors:
+	for (i = last_sq + 1; i <= max; i++)
+		dev->queues[i]->cq_vector = -1;
 
 	/*
 	 * Ignore failing Create SQ/CQ commands, we can continue with less
@@ -1512,6 +2514,51 @@ static ssize_t nvme_cmb_show(struct device *dev,
 }
 static DEVICE_ATTR(cmb, S_IRUGO, nvme_cmb_show, NULL);
 
+/*
+ * Carve the region for lists and write data off the end of the CMB, the
+ * SQs get what's left.  The pool works on bus addresses and is kept over
+ * resets: requests cancelled by a reset only release their allocation
+ * once the CMB has been unmapped.
+ */
+static void nvme_setup_cmb_pool(struct nvme_dev *dev)
+{
+	bool lists = use_cmb_lists && NVME_CMB_LISTS(dev->cmbsz);
+	bool wds = cmb_write_size && NVME_CMB_WDS(dev->cmbsz);
+	int node = dev_to_node(dev->dev);
+	dma_addr_t base;
+	u64 size;
+
+	if (!lists && !wds)
+		return;
+
+	if (!dev->cmb_pool) {
+		size = dev->cmb_size;
+		/* leave most of it to the SQs */
+		if (use_cmb_sqes && NVME_CMB_SQS(dev->cmbsz))
+			size >>= 2;
+		size = round_down(size, PAGE_SIZE);
+		base = dev->cmb_dma_addr + dev->cmb_size - size;
+		if (!size || base + size - 1 > ULONG_MAX)
+			return;
+
+		dev->cmb_pool = gen_pool_create(ilog2(256), node);
+		if (!dev->cmb_pool)
+			return;
+		if (gen_pool_add(dev->cmb_pool, base, size, node)) {
+			gen_pool_destroy(dev->cmb_pool);
+			dev->cmb_pool = NULL;
+			return;
+		}
+		dev->cmb_pool_size = size;
+	}
+
+	if (dev->cmb_pool_size > dev->cmb_size)
+		return;
+	dev->cmb_size -= dev->cmb_pool_size;
+	dev->cmb_lists = lists;
+	dev->cmb_wds = wds;
+}
+
 static void __iomem *nvme_map_cmb(struct nvme_dev *dev)
 {
 	u64 szu, size, offset;
@@ -1525,7 +2572,7 @@ static void __iomem *nvme_map_cmb(struct nvme_dev *dev)
 		return NULL;
 	dev->cmbloc = readl(dev->bar + NVME_REG_CMBLOC);
 
-	if (!use_cmb_sqes)
+	if (!use_cmb_sqes && !use_cmb_lists && !cmb_write_size)
 		return NULL;
 
 	szu = (u64)1 << (12 + 4 * NVME_CMB_SZU(dev->cmbsz));
@@ -1551,6 +2598,7 @@ static void __iomem *nvme_map_cmb(struct nvme_dev *dev)
 
 	dev->cmb_dma_addr = dma_addr;
 	dev->cmb_size = size;
+	nvme_setup_cmb_pool(dev);
 	return cmb;
 }
 
@@ -1559,6 +2607,8 @@ static inline void nvme_release_cmb(struct nvme_dev *dev)
 	if (dev->cmb) {
 		iounmap(dev->cmb);
 		dev->cmb = NULL;
+		dev->cmb_lists = false;
+		dev->cmb_wds = false;
 		sysfs_remove_file_from_group(&dev->ctrl.device->kobj,
 					     &dev_attr_cmb.attr, NULL);
 		dev->cmbsz = 0;
@@ -1597,26 +2647,55 @@ static int nvme_set_host_mem(struct nvme_dev *dev, u32 bits)
 	return ret;
 }
 
-static void nvme_free_host_mem(struct nvme_dev *dev)
+static void nvme_free_host_mem_bufs(struct nvme_dev *dev,
+		struct nvme_host_mem_buf_desc *descs, void **bufs, int nr)
 {
 	int i;
 
-	for (i = 0; i < dev->nr_host_mem_descs; i++) {
-		struct nvme_host_mem_buf_desc *desc = &dev->host_mem_descs[i];
-		size_t size = le32_to_cpu(desc->size) * dev->ctrl.page_size;
+	for (i = 0; i < nr; i++) {
+		size_t size = le32_to_cpu(descs[i].size) * dev->ctrl.page_size;
 
-		dma_free_coherent(dev->dev, size, dev->host_mem_desc_bufs[i],
-				le64_to_cpu(desc->addr));
+		dma_free_attrs(dev->dev, size, bufs[i],
+				le64_to_cpu(descs[i].addr),
+				DMA_ATTR_NO_KERNEL_MAPPING | DMA_ATTR_NO_WARN);
 	}
+}
 
-	kfree(dev->host_mem_desc_bufs);
-	dev->host_mem_desc_bufs = NULL;
-	kfree(dev->host_mem_descs);
+/*
+ * nvme_dev_disable() looks at the buffer under shutdown_lock, so take it
+ * away under the lock and free it after.
+ */
+static void nvme_free_host_mem(struct nvme_dev *dev)
+{
+	struct nvme_host_mem_buf_desc *descs;
+	void **bufs;
+	u32 nr;
+
+	mutex_lock(&dev->shutdown_lock);
+	descs = dev->host_mem_descs;
+	bufs = dev->host_mem_desc_bufs;
+	nr = dev->nr_host_mem_descs;
 	dev->host_mem_descs = NULL;
+	dev->host_mem_desc_bufs = NULL;
+	dev->nr_host_mem_descs = 0;
+	dev->host_mem_size = 0;
+	mutex_unlock(&dev->shutdown_lock);
+
+	nvme_free_host_mem_bufs(dev, descs, bufs, nr);
+	kfree(bufs);
+	kfree(descs);
 }
 
+/*
+ * The host memory buffer is only ever touched by the controller, so keep
+ * its descriptors on the controller's NUMA node (the DMA API allocates the
+ * buffer itself there), and use as few large chunks as the allocator will
+ * give us without retrying hard; every chunk is a descriptor the controller
+ * has to walk.  The buffer is published under shutdown_lock.
+ */
 static int nvme_alloc_host_mem(struct nvme_dev *dev, u64 min, u64 preferred)
 {
+	int node = dev_to_node(dev->dev);
 	struct nvme_host_mem_buf_desc *descs;
 	u32 chunk_size, max_entries, len;
 	int i = 0;
@@ -1624,16 +2703,16 @@ static int nvme_alloc_host_mem(struct nvme_dev *dev, u64 min, u64 preferred)
 	u64 size = 0, tmp;
 
 	/* start big and work our way down */
-	chunk_size = min(preferred, (u64)PAGE_SIZE << MAX_ORDER);
+	chunk_size = min(preferred, (u64)PAGE_SIZE << (MAX_ORDER - 1));
 retry:
 	tmp = (preferred + chunk_size - 1);
 	do_div(tmp, chunk_size);
 	max_entries = tmp;
-	descs = kcalloc(max_entries, sizeof(*descs), GFP_KERNEL);
+	descs = kcalloc_node(max_entries, sizeof(*descs), GFP_KERNEL, node);
 	if (!descs)
 		goto out;
 
-	bufs = kcalloc(max_entries, sizeof(*bufs), GFP_KERNEL);
+	bufs = kcalloc_node(max_entries, sizeof(*bufs), GFP_KERNEL, node);
 	if (!bufs)
 		goto out_free_descs;
 
@@ -1641,7 +2720,8 @@ retry:
 		dma_addr_t dma_addr;
 
 		len = min_t(u64, chunk_size, preferred - size);
-		bufs[i] = dma_alloc_attrs(dev->dev, len, &dma_addr, GFP_KERNEL,
+		bufs[i] = dma_alloc_attrs(dev->dev, len, &dma_addr,
+				GFP_KERNEL | __GFP_NORETRY,
 				DMA_ATTR_NO_KERNEL_MAPPING | DMA_ATTR_NO_WARN);
 		if (!bufs[i])
 			break;
@@ -1658,22 +2738,18 @@ retry:
 	}
 
 	dev_info(dev->ctrl.device,
-		"allocated %lld MiB host memory buffer.\n",
-		size >> ilog2(SZ_1M));
+		"allocated %lld MiB host memory buffer (%d chunks).\n",
+		size >> ilog2(SZ_1M), i);
+	mutex_lock(&dev->shutdown_lock);
 	dev->nr_host_mem_descs = i;
 	dev->host_mem_size = size;
 	dev->host_mem_descs = descs;
 	dev->host_mem_desc_bufs = bufs;
+	mutex_unlock(&dev->shutdown_lock);
 	return 0;
 
 out_free_bufs:
-	while (--i >= 0) {
-		size_t size = le32_to_cpu(descs[i].size) * dev->ctrl.page_size;
-
-		dma_free_coherent(dev->dev, size, bufs[i],
-				le64_to_cpu(descs[i].addr));
-	}
-
+	nvme_free_host_mem_bufs(dev, descs, bufs, i);
 	kfree(bufs);
 out_free_descs:
 	kfree(descs);
@@ -1681,45 +2757,171 @@ out:
 	/* try a smaller chunk size if we failed early */
 	if (chunk_size >= PAGE_SIZE * 2 && (i == 0 || size < min)) {
 		chunk_size /= 2;
+		i = 0;
 		goto retry;
 	}
-	dev->host_mem_descs = NULL;
 	return -ENOMEM;
 }
 
-static void nvme_setup_host_mem(struct nvme_dev *dev)
+/*
+ * Must be called with host_mem_lock held.  Returns 0 if the controller uses
+ * a host memory buffer or was not supposed to get one.
+ */
+static int nvme_setup_host_mem(struct nvme_dev *dev)
 {
-	u64 max = (u64)max_host_mem_size_mb * SZ_1M;
+	u64 max = dev->host_mem_limit;
 	u64 preferred = (u64)dev->ctrl.hmpre * 4096;
 	u64 min = (u64)dev->ctrl.hmmin * 4096;
 	u32 enable_bits = NVME_HOST_MEM_ENABLE;
+	int ret;
 
 	preferred = min(preferred, max);
 	if (min > max) {
 		dev_warn(dev->ctrl.device,
-			"min host memory (%lld MiB) above limit (%d MiB).\n",
-			min >> ilog2(SZ_1M), max_host_mem_size_mb);
+			"min host memory (%lld MiB) above limit (%lld MiB).\n",
+			min >> ilog2(SZ_1M), max >> ilog2(SZ_1M));
 		nvme_free_host_mem(dev);
-		return;
+		return 0;
+	}
+	if (!preferred) {
+		nvme_free_host_mem(dev);
+		return 0;
 	}
 
 	/*
-	 * If we already have a buffer allocated check if we can reuse it.
+	 * If we already have a buffer allocated check if we can reuse it.  It
+	 * may have been sized for an older limit while we were resetting.
 	 */
 	if (dev->host_mem_descs) {
-		if (dev->host_mem_size >= min)
+		if (dev->host_mem_size >= min && dev->host_mem_size <= preferred)
 			enable_bits |= NVME_HOST_MEM_RETURN;
 		else
 			nvme_free_host_mem(dev);
 	}
 
 	if (!dev->host_mem_descs) {
-		if (nvme_alloc_host_mem(dev, min, preferred))
-			return;
+		ret = nvme_alloc_host_mem(dev, min, preferred);
+		if (ret)
+			return ret;
 	}
 
-	if (nvme_set_host_mem(dev, enable_bits))
+	ret = nvme_set_host_mem(dev, enable_bits);
+	if (ret) {
 		nvme_free_host_mem(dev);
+		return ret > 0 ? -EIO : ret;
+	}
+	return 0;
+}
+
+/*
+ * Shrink or grow the host memory buffer of a live controller: tell it to
+ * stop using the current buffer, swap in one sized for the new limit and
+ * hand that over with a second Set Features.  The buffer only changes
+ * under shutdown_lock, but we never wait for a command with it held as the
+ * timeout handler needs it too.
+ */
+static int nvme_resize_host_mem(struct nvme_dev *dev, u64 limit)
+{
+	int ret = 0;
+
+	mutex_lock(&dev->host_mem_lock);
+	dev->host_mem_limit = limit;
+	if (!dev->ctrl.hmpre || dev->ctrl.state != NVME_CTRL_LIVE)
+		goto out_unlock;
+	if (dev->host_mem_descs &&
+	    dev->host_mem_size == min(limit, (u64)dev->ctrl.hmpre * 4096))
+		goto out_unlock;
+
+	if (dev->host_mem_descs) {
+		ret = nvme_set_host_mem(dev, 0);
+		if (ret) {
+			if (ret > 0)
+				ret = -EIO;
+			goto out_unlock;
+		}
+	}
+
+	nvme_free_host_mem(dev);
+	ret = nvme_setup_host_mem(dev);
+ out_unlock:
+	mutex_unlock(&dev->host_mem_lock);
+	return ret;
+}
+
+static ssize_t nvme_hmb_size_show(struct device *dev,
+				  struct device_attribute *attr,
+				  char *buf)
+{
+	struct nvme_dev *ndev = to_nvme_dev(dev_get_drvdata(dev));
+
+	return scnprintf(buf, PAGE_SIZE, "%llu %llu\n",
+			ndev->host_mem_size >> ilog2(SZ_1M),
+			ndev->host_mem_limit >> ilog2(SZ_1M));
+}
+
+static ssize_t nvme_hmb_size_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct nvme_dev *ndev = to_nvme_dev(dev_get_drvdata(dev));
+	unsigned int mb;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &mb);
+	if (ret)
+		return ret;
+
+	ret = nvme_resize_host_mem(ndev, (u64)mb * SZ_1M);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR(hmb_size_mb, S_IRUGO | S_IWUSR, nvme_hmb_size_show,
+		   nvme_hmb_size_store);
+
+static struct attribute *nvme_pci_attrs[] = {
+	&dev_attr_hmb_size_mb.attr,
+	NULL,
+};
+
+static const struct attribute_group nvme_pci_attr_group = {
+	.attrs		= nvme_pci_attrs,
+};
+
+/*
+ * Ask for NVME_NR_PRIO_SQS more SQs than CQs per I/O queue.  Returns 0 if
+ * the controller granted enough of them for every queue it allows.
+ */
+static int nvme_set_prio_queue_count(struct nvme_dev *dev, int *count)
+{
+	u32 nr_sqs = *count * (NVME_NR_PRIO_SQS + 1);
+	u32 result;
+	int status, nr_cqs;
+
+	status = nvme_set_features(&dev->ctrl, NVME_FEAT_NUM_QUEUES,
+			(nr_sqs - 1) | ((*count - 1) << 16), NULL, 0, &result);
+	if (status)
+		return -EIO;
+
+	nr_cqs = min_t(int, *count, (result >> 16) + 1);
+	if ((result & 0xffff) + 1 < nr_cqs * (NVME_NR_PRIO_SQS + 1))
+		return -ENOSPC;
+	*count = nr_cqs;
+	return 0;
+}
+
+static void nvme_set_arbitration(struct nvme_dev *dev)
+{
+	u32 dword11 = NVME_WRR_BURST;
+	int i, ret;
+
+	/* high, medium and low priority weights, all 0's based */
+	for (i = 0; i < ARRAY_SIZE(wrr_weights); i++)
+		dword11 |= (clamp(wrr_weights[i], 1U, 256U) - 1) << (24 - 8 * i);
+
+	ret = nvme_set_features(&dev->ctrl, NVME_FEAT_ARBITRATION, dword11,
+			NULL, 0, NULL);
+	if (ret)
+		dev_warn(dev->ctrl.device,
+			"failed to set arbitration weights: %d\n", ret);
 }
 
 static int nvme_setup_io_queues(struct nvme_dev *dev)
@@ -1729,15 +2931,27 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	int result, nr_io_queues;
 	unsigned long size;
 
+	/*
+	 * Priority SQs have no room in the shadow doorbell buffer, so they
+	 * aren't used together with it.
+	 */
 	nr_io_queues = num_present_cpus();
-	result = nvme_set_queue_count(&dev->ctrl, &nr_io_queues);
-	if (result < 0)
-		return result;
+	dev->prio_sqs = dev->ctrl.use_wrr && !dev->dbbuf_dbs &&
+			!nvme_set_prio_queue_count(dev, &nr_io_queues);
+	if (!dev->prio_sqs) {
+		nr_io_queues = num_present_cpus();
+		result = nvme_set_queue_count(&dev->ctrl, &nr_io_queues);
+		if (result < 0)
+			return result;
+	}
 
 	if (nr_io_queues == 0)
 		return 0;
 
-	if (dev->cmb && NVME_CMB_SQS(dev->cmbsz)) {
+	if (dev->ctrl.use_wrr)
+		nvme_set_arbitration(dev);
+
+	if (dev->cmb && use_cmb_sqes && NVME_CMB_SQS(dev->cmbsz)) {
 		result = nvme_cmb_qdepth(dev, nr_io_queues,
 				sizeof(struct nvme_command));
 		if (result > 0)
@@ -1747,7 +2961,9 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	}
 
 	do {
-		size = db_bar_size(dev, nr_io_queues);
+		size = db_bar_size(dev, dev->prio_sqs ?
+				nr_io_queues * (NVME_NR_PRIO_SQS + 1) :
+				nr_io_queues);
 		result = nvme_remap_bar(dev, size);
 		if (!result)
 			break;
@@ -1764,18 +2980,18 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	 * setting up the full range we need.
 	 */
 	pci_free_irq_vectors(pdev);
-	nr_io_queues = pci_alloc_irq_vectors(pdev, 1, nr_io_queues,
+	result = pci_alloc_irq_vectors(pdev, 1, nr_io_queues,
 			PCI_IRQ_ALL_TYPES | PCI_IRQ_AFFINITY);
-	if (nr_io_queues <= 0)
+	if (result <= 0)
 		return -EIO;
-	dev->max_qid = nr_io_queues;
 
 	/*
-	 * Should investigate if there's a performance win from allocating
-	 * more queues than interrupt vectors; it might allow the submission
-	 * path to scale better, even if the receive path is limited by the
-	 * number of interrupts.
+	 * Keep every queue the controller granted even if we got fewer
+	 * vectors: the extra queues share vectors, which leaves completions
+	 * bounded by the interrupt count but lets submission scale per CPU.
 	 */
+	dev->num_vecs = result;
+	dev->max_qid = nr_io_queues;
 
 	result = queue_request_irq(adminq);
 	if (result) {
@@ -1801,14 +3017,14 @@ static void nvme_del_cq_end(struct request *req, blk_status_t error)
 		unsigned long flags;
 
 		/*
-		 * We might be called with the AQ q_lock held
-		 * and the I/O queue q_lock should always
+		 * We might be called with the AQ cq_lock held
+		 * and the I/O queue cq_lock should always
 		 * nest inside the AQ one.
 		 */
-		spin_lock_irqsave_nested(&nvmeq->q_lock, flags,
+		spin_lock_irqsave_nested(&nvmeq->cq_lock, flags,
 					SINGLE_DEPTH_NESTING);
 		nvme_process_cq(nvmeq);
-		spin_unlock_irqrestore(&nvmeq->q_lock, flags);
+		spin_unlock_irqrestore(&nvmeq->cq_lock, flags);
 	}
 
 	nvme_del_queue_end(req, error);
@@ -1837,12 +3053,57 @@ static int nvme_delete_queue(struct nvme_queue *nvmeq, u8 opcode)
 	return 0;
 }
 
+/* Priority SQs have to go before the CQ of their queue */
+static void nvme_delete_prio_sqs(struct nvme_dev *dev, int queues)
+{
+	unsigned long timeout = ADMIN_TIMEOUT;
+	int qid, i, ret, sent = 0;
+
+	reinit_completion(&dev->ioq_wait);
+	for (qid = 1; qid <= queues; qid++) {
+		struct nvme_queue *nvmeq = dev->queues[qid];
+
+		if (!nvmeq->prio_sqs_live)
+			continue;
+		nvmeq->prio_sqs_live = false;
+
+		/*
+		 * Every priority SQ has to go before the CQs can be deleted,
+		 * so don't give up on the rest when we run out of requests.
+		 */
+		for (i = 0; i < NVME_NR_PRIO_SQS; i++) {
+			struct nvme_queue *sq = nvmeq->prio_sqs[i];
+
+			while ((ret = nvme_delete_queue(sq,
+					nvme_admin_delete_sq)) && sent) {
+				timeout = wait_for_completion_io_timeout(
+						&dev->ioq_wait, timeout);
+				if (timeout == 0)
+					return;
+				sent--;
+			}
+			if (ret)
+				adapter_delete_sq(dev, sq->qid);
+			else
+				sent++;
+		}
+	}
+
+	while (sent--) {
+		timeout = wait_for_completion_io_timeout(&dev->ioq_wait, timeout);
+		if (timeout == 0)
+			return;
+	}
+}
+
 static void nvme_disable_io_queues(struct nvme_dev *dev, int queues)
 {
 	int pass;
 	unsigned long timeout;
 	u8 opcode = nvme_admin_delete_sq;
 
+	nvme_delete_prio_sqs(dev, queues);
+
 	for (pass = 0; pass < 2; pass++) {
 		int sent = 0, i = queues;
 
@@ -1892,7 +3153,9 @@ static int nvme_dev_add(struct nvme_dev *dev)
 		blk_mq_update_nr_hw_queues(&dev->tagset, dev->online_queues - 1);
 
 		/* Free previously allocated queues that are no longer usable */
+		mutex_lock(&dev->shutdown_lock);
 		nvme_free_queues(dev, dev->online_queues);
+		mutex_unlock(&dev->shutdown_lock);
 	}
 
 	return 0;
@@ -2002,6 +3265,12 @@ static void nvme_dev_disable(struct nvme_dev *dev, bool shutdown)
 	bool dead = true;
 	struct pci_dev *pdev = to_pci_dev(dev->dev);
 
+	/*
+	 * Not the _sync variant: the work may be waiting on an admin command
+	 * that only gets cancelled further down.
+	 */
+	cancel_delayed_work(&dev->coalesce_work);
+
 	mutex_lock(&dev->shutdown_lock);
 	if (pci_is_enabled(pdev)) {
 		u32 csts = readl(dev->bar + NVME_REG_CSTS);
@@ -2073,15 +3342,43 @@ static int nvme_setup_prp_pools(struct nvme_dev *dev)
 	/* Optimisation for I/Os between 4k and 128k */
 	dev->prp_small_pool = dma_pool_create("prp list 256", dev->dev,
 						256, 256, 0);
-	if (!dev->prp_small_pool) {
-		dma_pool_destroy(dev->prp_page_pool);
-		return -ENOMEM;
-	}
+	if (!dev->prp_small_pool)
+		goto destroy_page_pool;
+
+	dev->prp_caches = alloc_percpu(struct nvme_prp_caches);
+	if (!dev->prp_caches)
+		goto destroy_small_pool;
 	return 0;
+
+ destroy_small_pool:
+	dma_pool_destroy(dev->prp_small_pool);
+ destroy_page_pool:
+	dma_pool_destroy(dev->prp_page_pool);
+	return -ENOMEM;
+}
+
+static void nvme_drain_prp_cache(struct nvme_prp_cache *cache,
+		struct dma_pool *pool)
+{
+	while (cache->nr) {
+		cache->nr--;
+		dma_pool_free(pool, cache->addr[cache->nr],
+				cache->dma[cache->nr]);
+	}
 }
 
 static void nvme_release_prp_pools(struct nvme_dev *dev)
 {
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct nvme_prp_caches *caches;
+
+		caches = per_cpu_ptr(dev->prp_caches, cpu);
+		nvme_drain_prp_cache(&caches->small, dev->prp_small_pool);
+		nvme_drain_prp_cache(&caches->page, dev->prp_page_pool);
+	}
+	free_percpu(dev->prp_caches);
 	dma_pool_destroy(dev->prp_page_pool);
 	dma_pool_destroy(dev->prp_small_pool);
 }
@@ -2098,6 +3395,9 @@ static void nvme_pci_free_ctrl(struct nvme_ctrl *ctrl)
 		blk_put_queue(dev->ctrl.admin_q);
 	kfree(dev->queues);
 	free_opal_dev(dev->ctrl.opal_dev);
+	mempool_destroy(dev->iod_mempool);
+	if (dev->cmb_pool)
+		gen_pool_destroy(dev->cmb_pool);
 	kfree(dev);
 }
 
@@ -2111,11 +3411,128 @@ static void nvme_remove_dead_ctrl(struct nvme_dev *dev, int status)
 		nvme_put_ctrl(&dev->ctrl);
 }
 
+/*
+ * Sample the completion rate of every vector each period, and how many
+ * commands its queues had in flight when their interrupts came in.  Only
+ * vectors above irq_coalesce_rate that also run deep enough for several
+ * completions to share an interrupt get coalescing, the others have it
+ * disabled through Interrupt Vector Configuration.  At queue depth 1 every
+ * completion would wait for the aggregation time, so those always keep an
+ * interrupt per completion however fast they go.  The controller-wide
+ * aggregation threshold is half the depth of the shallowest coalesced
+ * vector, so that none of them waits for the timer in the steady state.
+ */
+static void nvme_coalesce_work(struct work_struct *work)
+{
+	struct nvme_dev *dev = container_of(to_delayed_work(work),
+			struct nvme_dev, coalesce_work);
+	unsigned long min_depth = ULONG_MAX;
+	unsigned int vec, qid;
+	u32 cfg = 0;
+	int ret;
+
+	if (dev->ctrl.state != NVME_CTRL_LIVE)
+		return;
+
+	for (vec = 0; vec < dev->num_vecs && vec + 1 < dev->online_queues;
+	     vec++) {
+		struct nvme_queue *owner = dev->queues[vec + 1];
+		unsigned long rate = 0, irqs = 0, depth = 0;
+		bool off;
+
+		for (qid = vec + 1; qid < dev->online_queues;
+		     qid += dev->num_vecs) {
+			struct nvme_queue *nvmeq = dev->queues[qid];
+			unsigned long nr;
+
+			nr = READ_ONCE(nvmeq->nr_cqes);
+			rate += nr - nvmeq->last_nr_cqes;
+			nvmeq->last_nr_cqes = nr;
+			nr = READ_ONCE(nvmeq->nr_irqs);
+			irqs += nr - nvmeq->last_nr_irqs;
+			nvmeq->last_nr_irqs = nr;
+			nr = READ_ONCE(nvmeq->irq_depth);
+			depth += nr - nvmeq->last_irq_depth;
+			nvmeq->last_irq_depth = nr;
+		}
+		rate = rate * HZ / NVME_COALESCE_PERIOD;
+		/* average commands in flight per interrupt */
+		depth = irqs ? depth / irqs : 0;
+
+		/* leave some hysteresis so vectors near the rate don't flap */
+		if (owner->coalesce_off)
+			off = rate < irq_coalesce_rate;
+		else
+			off = rate < irq_coalesce_rate / 2;
+		if (depth < 2)
+			off = true;
+
+		if (off != owner->coalesce_off) {
+			ret = nvme_set_features(&dev->ctrl, NVME_FEAT_IRQ_CONFIG,
+					vec | (off ? NVME_IV_CD : 0), NULL, 0, NULL);
+			if (ret)
+				goto out_disable;
+			owner->coalesce_off = off;
+		}
+		if (!off)
+			min_depth = min(min_depth, depth);
+	}
+
+	if (min_depth != ULONG_MAX) {
+		u32 aggr = min_t(unsigned long,
+				rounddown_pow_of_two(min_depth / 2),
+				NVME_COALESCE_MAX_AGGR);
+
+		cfg = (aggr - 1) | (NVME_COALESCE_TIME << 8);
+	}
+
+	if (cfg != dev->coalesce_cfg) {
+		ret = nvme_set_features(&dev->ctrl, NVME_FEAT_IRQ_COALESCE, cfg,
+				NULL, 0, NULL);
+		if (ret)
+			goto out_disable;
+		dev->coalesce_cfg = cfg;
+	}
+
+	queue_delayed_work(nvme_wq, &dev->coalesce_work, NVME_COALESCE_PERIOD);
+	return;
+
+ out_disable:
+	/* negative errors mean we're being reset, which restarts us */
+	if (ret > 0)
+		dev_warn(dev->ctrl.device,
+			"interrupt coalescing disabled, status %#x\n", ret);
+}
+
+static void nvme_start_coalescing(struct nvme_dev *dev)
+{
+	unsigned int qid;
+
+	if (!irq_coalesce_rate)
+		return;
+
+	/*
+	 * A controller reset puts both features back to their defaults, with
+	 * coalescing enabled on every vector.
+	 */
+	dev->coalesce_cfg = 0;
+	for (qid = 1; qid < dev->online_queues; qid++) {
+		struct nvme_queue *nvmeq = dev->queues[qid];
+
+		nvmeq->coalesce_off = false;
+		nvmeq->last_nr_cqes = READ_ONCE(nvmeq->nr_cqes);
+		nvmeq->last_nr_irqs = READ_ONCE(nvmeq->nr_irqs);
+		nvmeq->last_irq_depth = READ_ONCE(nvmeq->irq_depth);
+	}
+	queue_delayed_work(nvme_wq, &dev->coalesce_work, NVME_COALESCE_PERIOD);
+}
+
 static void nvme_reset_work(struct work_struct *work)
 {
 	struct nvme_dev *dev =
 		container_of(work, struct nvme_dev, ctrl.reset_work);
 	bool was_suspend = !!(dev->ctrl.ctrl_config & NVME_CC_SHN_NORMAL);
+	ktime_t start = ktime_get();
 	int result = -ENODEV;
 
 	if (WARN_ON(dev->ctrl.state != NVME_CTRL_RESETTING))
@@ -2141,6 +3558,13 @@ static void nvme_reset_work(struct work_struct *work)
 	if (result)
 		goto out;
 
+	/*
+	 * Limit the max command size to what the iod mempool elements can
+	 * describe, nvme_init_identify() lowers it further based on MDTS.
+	 */
+	dev->ctrl.max_hw_sectors = NVME_MAX_KB_SZ << 1;
+	dev->ctrl.max_segments = NVME_MAX_SEGS;
+
 	result = nvme_init_identify(&dev->ctrl);
 	if (result)
 		goto out;
@@ -2163,8 +3587,11 @@ static void nvme_reset_work(struct work_struct *work)
 				 "unable to allocate dma for dbbuf\n");
 	}
 
-	if (dev->ctrl.hmpre)
+	if (dev->ctrl.hmpre) {
+		mutex_lock(&dev->host_mem_lock);
 		nvme_setup_host_mem(dev);
+		mutex_unlock(&dev->host_mem_lock);
+	}
 
 	result = nvme_setup_io_queues(dev);
 	if (result)
@@ -2191,6 +3618,11 @@ static void nvme_reset_work(struct work_struct *work)
 	}
 
 	nvme_start_ctrl(&dev->ctrl);
+	if (dev->online_queues > 1)
+		nvme_start_coalescing(dev);
+
+	dev_info(dev->ctrl.device, "ready in %lld ms, %u I/O queues\n",
+		 ktime_ms_delta(ktime_get(), start), dev->online_queues - 1);
 	return;
 
  out:
@@ -2235,6 +3667,7 @@ static const struct nvme_ctrl_ops nvme_pci_ctrl_ops = {
 	.reg_read64		= nvme_pci_reg_read64,
 	.free_ctrl		= nvme_pci_free_ctrl,
 	.submit_async_event	= nvme_pci_submit_async_event,
+	.dev_attr_group		= &nvme_pci_attr_group,
 };
 
 static int nvme_dev_map(struct nvme_dev *dev)
@@ -2273,6 +3706,81 @@ static unsigned long check_dell_samsung_bug(struct pci_dev *pdev)
 	return 0;
 }
 
+static struct dentry *nvme_debugfs_root;
+
+/*
+ * Per-queue submission and completion counts.  Doorbells per I/O is
+ * sq_doorbells / sq_cmds; shadow doorbell writes that skip the MMIO are
+ * not counted.
+ */
+static int nvme_queue_stats_show(struct seq_file *m, void *unused)
+{
+	struct nvme_dev *dev = m->private;
+	int i, j;
+
+	/* queues are freed under shutdown_lock */
+	mutex_lock(&dev->shutdown_lock);
+	for (i = 0; i < dev->ctrl.queue_count; i++) {
+		struct nvme_queue *nvmeq = dev->queues[i];
+
+		if (!nvmeq)
+			continue;
+		seq_printf(m, "queue %d: sq_cmds %lu sq_doorbells %lu",
+			   i, READ_ONCE(nvmeq->nr_sq_cmds),
+			   READ_ONCE(nvmeq->nr_sq_dbs));
+		seq_printf(m, " cqes %lu\n", READ_ONCE(nvmeq->nr_cqes));
+
+		for (j = 0; j < NVME_NR_PRIO_SQS; j++) {
+			struct nvme_queue *sq = nvmeq->prio_sqs[j];
+
+			if (!sq)
+				continue;
+			seq_printf(m, "queue %d sq %d: sq_cmds %lu",
+				   i, sq->qid, READ_ONCE(sq->nr_sq_cmds));
+			seq_printf(m, " sq_doorbells %lu\n",
+				   READ_ONCE(sq->nr_sq_dbs));
+		}
+	}
+	mutex_unlock(&dev->shutdown_lock);
+
+	return 0;
+}
+
+static int nvme_queue_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvme_queue_stats_show, inode->i_private);
+}
+
+static const struct file_operations nvme_queue_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nvme_queue_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void nvme_debugfs_add(struct nvme_dev *dev)
+{
+	if (!nvme_debugfs_root)
+		return;
+
+	dev->debugfs_dir = debugfs_create_dir(dev_name(dev->ctrl.device),
+			nvme_debugfs_root);
+	if (IS_ERR_OR_NULL(dev->debugfs_dir)) {
+		dev->debugfs_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("queue_stats", 0400, dev->debugfs_dir, dev,
+			&nvme_queue_stats_fops);
+}
+
+static void nvme_debugfs_remove(struct nvme_dev *dev)
+{
+	debugfs_remove_recursive(dev->debugfs_dir);
+	dev->debugfs_dir = NULL;
+}
+
 static int nvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 {
 	int node, result = -ENOMEM;
@@ -2300,26 +3808,42 @@ static int nvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 
 	INIT_WORK(&dev->ctrl.reset_work, nvme_reset_work);
 	INIT_WORK(&dev->remove_work, nvme_remove_dead_ctrl_work);
+	INIT_DELAYED_WORK(&dev->coalesce_work, nvme_coalesce_work);
 	mutex_init(&dev->shutdown_lock);
+	mutex_init(&dev->host_mem_lock);
+	dev->host_mem_limit = (u64)max_host_mem_size_mb * SZ_1M;
 	init_completion(&dev->ioq_wait);
+	init_completion(&dev->ioq_create_wait);
 
 	result = nvme_setup_prp_pools(dev);
 	if (result)
 		goto unmap;
 
+	dev->iod_mempool = mempool_create_node(1, mempool_kmalloc,
+			mempool_kfree, (void *)(uintptr_t)nvme_iod_max_alloc_size(),
+			GFP_KERNEL, node);
+	if (!dev->iod_mempool) {
+		result = -ENOMEM;
+		goto release_pools;
+	}
+
 	quirks |= check_dell_samsung_bug(pdev);
 
 	result = nvme_init_ctrl(&dev->ctrl, &pdev->dev, &nvme_pci_ctrl_ops,
 			quirks);
 	if (result)
-		goto release_pools;
+		goto release_mempool;
 
 	nvme_change_ctrl_state(&dev->ctrl, NVME_CTRL_RESETTING);
 	dev_info(dev->ctrl.device, "pci function %s\n", dev_name(&pdev->dev));
 
+	nvme_debugfs_add(dev);
+
 	queue_work(nvme_wq, &dev->ctrl.reset_work);
 	return 0;
 
+ release_mempool:
+	mempool_destroy(dev->iod_mempool);
  release_pools:
 	nvme_release_prp_pools(dev);
  unmap:
@@ -2360,6 +3884,7 @@ static void nvme_remove(struct pci_dev *pdev)
 	struct nvme_dev *dev = pci_get_drvdata(pdev);
 
 	nvme_change_ctrl_state(&dev->ctrl, NVME_CTRL_DELETING);
+	nvme_debugfs_remove(dev);
 
 	cancel_work_sync(&dev->ctrl.reset_work);
 	pci_set_drvdata(pdev, NULL);
@@ -2370,10 +3895,14 @@ static void nvme_remove(struct pci_dev *pdev)
 	}
 
 	flush_work(&dev->ctrl.reset_work);
+	cancel_delayed_work_sync(&dev->coalesce_work);
 	nvme_stop_ctrl(&dev->ctrl);
 	nvme_remove_namespaces(&dev->ctrl);
 	nvme_dev_disable(dev, true);
+	/* hmb_size_mb stays until the ctrl device goes, don't race with it */
+	mutex_lock(&dev->host_mem_lock);
 	nvme_free_host_mem(dev);
+	mutex_unlock(&dev->host_mem_lock);
 	nvme_dev_remove_admin(dev);
 	nvme_free_queues(dev, 0);
 	nvme_uninit_ctrl(&dev->ctrl);
@@ -2511,6 +4040,8 @@ static struct pci_driver nvme_driver = {
 	.shutdown	= nvme_shutdown,
 	.driver		= {
 		.pm	= &nvme_dev_pm_ops,
+		/* controllers come up from nvme_wq, let probe not wait either */
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.sriov_configure = nvme_pci_sriov_configure,
 	.err_handler	= &nvme_err_handler,
@@ -2518,12 +4049,23 @@ static struct pci_driver nvme_driver = {
 
 static int __init nvme_init(void)
 {
-	return pci_register_driver(&nvme_driver);
+	int ret;
+
+	/* debugfs is optional, the statistics just won't be visible */
+	nvme_debugfs_root = debugfs_create_dir("nvme_pci", NULL);
+	if (IS_ERR(nvme_debugfs_root))
+		nvme_debugfs_root = NULL;
+
+	ret = pci_register_driver(&nvme_driver);
+	if (ret)
+		debugfs_remove_recursive(nvme_debugfs_root);
+	return ret;
 }
 
 static void __exit nvme_exit(void)
 {
 	pci_unregister_driver(&nvme_driver);
+	debugfs_remove_recursive(nvme_debugfs_root);
 	_nvme_check_size();
 }
 
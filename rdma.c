@@ -24,6 +24,13 @@
 #include <linux/mutex.h>
 #include <linux/scatterlist.h>
 #include <linux/nvme.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/highmem.h>
+#include <linux/irq_poll.h>
+#include <linux/prefetch.h>
+#include <linux/t10-pi.h>
 #include <asm/unaligned.h>
 
 #include <rdma/ib_verbs.h>
@@ -40,6 +47,12 @@
 
 #define NVME_RDMA_MAX_INLINE_SEGMENTS	1
 
+/* send queue WRs needed per command: MR, SEND, INV */
+#define NVME_RDMA_SEND_WR_FACTOR	3
+
+/* with PI offload: MR, SIG_MR, SEND, INV, SIG_INV */
+#define NVME_RDMA_PI_SEND_WR_FACTOR	5
+
 /*
  * We handle AEN commands ourselves and don't even let the
  * block layer know about them.
@@ -53,6 +66,20 @@ struct nvme_rdma_device {
 	struct ib_pd	       *pd;
 	struct kref		ref;
 	struct list_head	entry;
+
+	/* CQs shared by the queues of all controllers on this device */
+	struct list_head	cq_list;
+	struct mutex		cq_mutex;
+};
+
+struct nvme_rdma_cq {
+	struct ib_cq		*cq;
+	struct irq_poll		iop;
+	spinlock_t		lock;	/* serializes reapers */
+	struct list_head	entry;
+	int			comp_vector;
+	int			nr_cqe;
+	int			used_cqe;
 };
 
 struct nvme_rdma_qe {
@@ -61,6 +88,74 @@ struct nvme_rdma_qe {
 	u64			dma;
 };
 
+/*
+ * Per-queue transport statistics, kept per-CPU so that the hot path never
+ * shares a cacheline.  Exposed through debugfs.
+ */
+enum nvme_rdma_stat {
+	NVME_RDMA_STAT_MAP_INLINE,	/* data sent inline in the capsule */
+	NVME_RDMA_STAT_MAP_SINGLE,	/* single SGL using the global rkey */
+	NVME_RDMA_STAT_MAP_FR,		/* fast registration MR */
+	NVME_RDMA_STAT_MAP_BOUNCE,	/* small read into a bounce buffer */
+	NVME_RDMA_STAT_MAP_PI,		/* signature MR for PI offload */
+	NVME_RDMA_STAT_REMOTE_INV,	/* rkey invalidated by the target */
+	NVME_RDMA_STAT_LOCAL_INV,	/* LOCAL_INV WR posted by us */
+	NVME_RDMA_STAT_SEND,
+	NVME_RDMA_STAT_SEND_SIGNALED,
+	NVME_RDMA_STAT_RECV_POSTED,
+	NVME_RDMA_STAT_BUSY,		/* BLK_STS_RESOURCE returned */
+	NVME_RDMA_STAT_WR_ERROR,
+	NVME_RDMA_STAT_PI_ERROR,	/* PI check failed in the HCA */
+	NVME_RDMA_STAT_NR,
+};
+
+static const char * const nvme_rdma_stat_names[NVME_RDMA_STAT_NR] = {
+	[NVME_RDMA_STAT_MAP_INLINE]	= "map_inline",
+	[NVME_RDMA_STAT_MAP_SINGLE]	= "map_single",
+	[NVME_RDMA_STAT_MAP_FR]		= "map_fr",
+	[NVME_RDMA_STAT_MAP_BOUNCE]	= "map_bounce",
+	[NVME_RDMA_STAT_MAP_PI]		= "map_pi",
+	[NVME_RDMA_STAT_REMOTE_INV]	= "remote_inv",
+	[NVME_RDMA_STAT_LOCAL_INV]	= "local_inv",
+	[NVME_RDMA_STAT_SEND]		= "send",
+	[NVME_RDMA_STAT_SEND_SIGNALED]	= "send_signaled",
+	[NVME_RDMA_STAT_RECV_POSTED]	= "recv_posted",
+	[NVME_RDMA_STAT_BUSY]		= "busy",
+	[NVME_RDMA_STAT_WR_ERROR]	= "wr_error",
+	[NVME_RDMA_STAT_PI_ERROR]	= "pi_error",
+};
+
+struct nvme_rdma_queue_stats {
+	u64			cnt[NVME_RDMA_STAT_NR];
+};
+
+#define nvme_rdma_stat_inc(queue, stat) \
+	this_cpu_inc((queue)->stats->cnt[stat])
+
+/* completions reaped per irq_poll invocation */
+#define NVME_RDMA_POLL_BUDGET		64
+
+/* WCs polled from the CQ and processed together */
+#define NVME_RDMA_POLL_BATCH		16
+
+/* minimum size of a CQ in the per-device pool */
+#define NVME_RDMA_CQ_POOL_SIZE		4096
+
+/*
+ * Requests completed by one batch of WCs, the LOCAL_INV WRs that must be
+ * posted before they can be completed and the receives to repost.
+ */
+struct nvme_rdma_cq_batch {
+	struct nvme_rdma_queue	*queue;
+	struct ib_send_wr	*inv_first;
+	struct ib_send_wr	*inv_last;
+	struct request		*rqs[NVME_RDMA_POLL_BATCH];
+	int			nr;
+	struct ib_recv_wr	recv_wr[NVME_RDMA_POLL_BATCH];
+	struct ib_sge		recv_sge[NVME_RDMA_POLL_BATCH];
+	int			nr_recv;
+};
+
 struct nvme_rdma_queue;
 struct nvme_rdma_request {
 	struct nvme_request	req;
@@ -70,8 +165,18 @@ struct nvme_rdma_request {
 	u32			num_sge;
 	int			nents;
 	bool			inline_data;
+	bool			bounce;
 	struct ib_reg_wr	reg_wr;
+	struct ib_send_wr	inv_wr;
 	struct ib_cqe		reg_cqe;
+
+	/* T10-PI offload, see nvme_rdma_map_pi() */
+	struct ib_mr		*sig_mr;
+	bool			use_sig_mr;
+	struct ib_sig_handover_wr sig_wr;
+	struct ib_sig_attrs	sig_attrs;
+	struct ib_sge		sig_data_sge;
+	struct ib_send_wr	sig_inv_wr;
 	struct nvme_rdma_queue  *queue;
 	struct sg_table		sg_table;
 	struct scatterlist	first_sgl[];
@@ -80,22 +185,35 @@ struct nvme_rdma_request {
 enum nvme_rdma_queue_flags {
 	NVME_RDMA_Q_LIVE		= 0,
 	NVME_RDMA_Q_DELETING		= 1,
+	NVME_RDMA_Q_DRAINING		= 2,
 };
 
 struct nvme_rdma_queue {
 	struct nvme_rdma_qe	*rsp_ring;
-	atomic_t		sig_count;
+	unsigned int __percpu	*unsignaled_wrs;
+	unsigned int		sig_limit;
 	int			queue_size;
 	size_t			cmnd_capsule_len;
 	struct nvme_rdma_ctrl	*ctrl;
 	struct nvme_rdma_device	*device;
+	struct nvme_rdma_cq	*cq;
 	struct ib_cq		*ib_cq;
+	int			nr_cqe;
 	struct ib_qp		*qp;
 
 	unsigned long		flags;
 	struct rdma_cm_id	*cm_id;
 	int			cm_error;
 	struct completion	cm_done;
+
+	/* pre-registered receive buffers for small reads, one per tag */
+	struct ib_mr		*bounce_mr;
+	struct page		**bounce_pages;
+	u64			*bounce_dma;
+	int			nr_bounce;
+	struct ib_cqe		bounce_reg_cqe;
+
+	struct nvme_rdma_queue_stats __percpu *stats;
 };
 
 struct nvme_rdma_ctrl {
@@ -117,10 +235,13 @@ struct nvme_rdma_ctrl {
 	struct nvme_rdma_device	*device;
 
 	u32			max_fr_pages;
+	u32			nr_write_queues;
 
 	struct sockaddr_storage addr;
 	struct sockaddr_storage src_addr;
 
+	struct dentry		*debugfs_dir;
+
 	struct nvme_ctrl	ctrl;
 };
 
@@ -135,6 +256,8 @@ static DEFINE_MUTEX(device_list_mutex);
 static LIST_HEAD(nvme_rdma_ctrl_list);
 static DEFINE_MUTEX(nvme_rdma_ctrl_mutex);
 
+static struct dentry *nvme_rdma_debugfs_root;
+
 /*
  * Disabling this option makes small I/O goes faster, but is fundamentally
  * unsafe.  With it turned off we will have to register a global rkey that
@@ -145,9 +268,33 @@ module_param(register_always, bool, 0444);
 MODULE_PARM_DESC(register_always,
 	 "Use memory registration even for contiguous memory regions");
 
+/*
+ * Reads up to this size are placed by the target into a per-queue buffer
+ * that is registered once when the queue is connected, and copied to the
+ * request's pages on completion.  This trades a small memcpy for the
+ * memory registration and invalidation WRs of every small read.
+ */
+static unsigned int small_read_size;
+module_param(small_read_size, uint, 0444);
+MODULE_PARM_DESC(small_read_size,
+	 "Receive reads up to this size (max PAGE_SIZE) into pre-registered buffers (0 = disabled)");
+
+/*
+ * Let the HCA insert T10-PI on writes and verify and strip it on reads
+ * using signature MRs, so that namespaces formatted with protection
+ * information are protected end to end without the host computing guard
+ * tags.
+ */
+static bool pi_offload;
+module_param(pi_offload, bool, 0444);
+MODULE_PARM_DESC(pi_offload,
+	 "Offload T10-PI generation and verification to the HCA if supported");
+
 static int nvme_rdma_cm_handler(struct rdma_cm_id *cm_id,
 		struct rdma_cm_event *event);
 static void nvme_rdma_recv_done(struct ib_cq *cq, struct ib_wc *wc);
+static void nvme_rdma_cq_event(struct ib_cq *cq, void *cq_context);
+static int nvme_rdma_iop_poll(struct irq_poll *iop, int budget);
 
 static const struct blk_mq_ops nvme_rdma_mq_ops;
 static const struct blk_mq_ops nvme_rdma_admin_mq_ops;
@@ -165,18 +312,43 @@ static inline int nvme_rdma_queue_idx(struct nvme_rdma_queue *queue)
 	return queue - queue->ctrl->queues;
 }
 
+/* CQs may be shared between queues, so find the queue through the QP */
+static inline struct nvme_rdma_queue *nvme_rdma_wc_queue(struct ib_wc *wc)
+{
+	return wc->qp->qp_context;
+}
+
+static inline int nvme_rdma_send_wr_factor(struct nvme_rdma_queue *queue)
+{
+	if (queue->ctrl->ctrl.pi_offload && nvme_rdma_queue_idx(queue))
+		return NVME_RDMA_PI_SEND_WR_FACTOR;
+	return NVME_RDMA_SEND_WR_FACTOR;
+}
+
 static inline size_t nvme_rdma_inline_data_size(struct nvme_rdma_queue *queue)
 {
 	return queue->cmnd_capsule_len - sizeof(struct nvme_command);
 }
 
+/*
+ * I/O queues are laid out as nr_hw_queues default queues (one per hctx)
+ * followed by nr_write_queues write queues.  Write queue i is paired with
+ * hctx i and shares its tag space, so command ids stay unique per queue.
+ */
+static inline unsigned int nvme_rdma_nr_hw_queues(struct nvme_rdma_ctrl *ctrl)
+{
+	return ctrl->ctrl.queue_count - 1 - ctrl->nr_write_queues;
+}
+
 static struct blk_mq_tags *nvme_rdma_tagset(struct nvme_rdma_queue *queue)
 {
 	u32 queue_idx = nvme_rdma_queue_idx(queue);
+	struct nvme_rdma_ctrl *ctrl = queue->ctrl;
 
 	if (queue_idx == 0)
-		return queue->ctrl->admin_tag_set.tags[queue_idx];
-	return queue->ctrl->tag_set.tags[queue_idx - 1];
+		return ctrl->admin_tag_set.tags[queue_idx];
+	return ctrl->tag_set.tags[(queue_idx - 1) %
+			nvme_rdma_nr_hw_queues(ctrl)];
 }
 
 static void nvme_rdma_free_qe(struct ib_device *ibdev, struct nvme_rdma_qe *qe,
@@ -261,6 +433,7 @@ static int nvme_rdma_create_qp(struct nvme_rdma_queue *queue, const int factor)
 
 	memset(&init_attr, 0, sizeof(init_attr));
 	init_attr.event_handler = nvme_rdma_qp_event;
+	init_attr.qp_context = queue;
 	/* +1 for drain */
 	init_attr.cap.max_send_wr = factor * queue->queue_size + 1;
 	/* +1 for drain */
@@ -278,6 +451,23 @@ static int nvme_rdma_create_qp(struct nvme_rdma_queue *queue, const int factor)
 	return ret;
 }
 
+static int nvme_rdma_alloc_sig_mr(struct nvme_rdma_ctrl *ctrl,
+		struct nvme_rdma_request *req)
+{
+	if (!ctrl->ctrl.pi_offload)
+		return 0;
+
+	req->sig_mr = ib_alloc_mr(ctrl->device->pd, IB_MR_TYPE_SIGNATURE, 2);
+	if (IS_ERR(req->sig_mr)) {
+		int ret = PTR_ERR(req->sig_mr);
+
+		req->sig_mr = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
 static int nvme_rdma_reinit_request(void *data, struct request *rq)
 {
 	struct nvme_rdma_ctrl *ctrl = data;
@@ -297,6 +487,13 @@ static int nvme_rdma_reinit_request(void *data, struct request *rq)
 
 	req->mr->need_inval = false;
 
+	/* only I/O requests ever had a signature MR */
+	if (req->sig_mr) {
+		ib_dereg_mr(req->sig_mr);
+		req->sig_mr = NULL;
+		ret = nvme_rdma_alloc_sig_mr(ctrl, req);
+	}
+
 out:
 	return ret;
 }
@@ -312,6 +509,8 @@ static void nvme_rdma_exit_request(struct blk_mq_tag_set *set,
 
 	if (req->mr)
 		ib_dereg_mr(req->mr);
+	if (req->sig_mr)
+		ib_dereg_mr(req->sig_mr);
 
 	nvme_rdma_free_qe(dev->dev, &req->sqe, sizeof(struct nvme_command),
 			DMA_TO_DEVICE);
@@ -341,10 +540,18 @@ static int nvme_rdma_init_request(struct blk_mq_tag_set *set,
 		goto out_free_qe;
 	}
 
+	if (queue_idx) {
+		ret = nvme_rdma_alloc_sig_mr(ctrl, req);
+		if (ret)
+			goto out_dereg_mr;
+	}
+
 	req->queue = queue;
 
 	return 0;
 
+out_dereg_mr:
+	ib_dereg_mr(req->mr);
 out_free_qe:
 	nvme_rdma_free_qe(dev->dev, &req->sqe, sizeof(struct nvme_command),
 			DMA_TO_DEVICE);
@@ -384,6 +591,7 @@ static void nvme_rdma_free_dev(struct kref *ref)
 	list_del(&ndev->entry);
 	mutex_unlock(&device_list_mutex);
 
+	WARN_ON_ONCE(!list_empty(&ndev->cq_list));
 	ib_dealloc_pd(ndev->pd);
 	kfree(ndev);
 }
@@ -416,6 +624,8 @@ nvme_rdma_find_get_device(struct rdma_cm_id *cm_id)
 
 	ndev->dev = cm_id->device;
 	kref_init(&ndev->ref);
+	INIT_LIST_HEAD(&ndev->cq_list);
+	mutex_init(&ndev->cq_mutex);
 
 	ndev->pd = ib_alloc_pd(ndev->dev,
 		register_always ? 0 : IB_PD_UNSAFE_GLOBAL_RKEY);
@@ -443,6 +653,147 @@ out_err:
 	return NULL;
 }
 
+static void nvme_rdma_free_bounce(struct nvme_rdma_queue *queue)
+{
+	struct ib_device *ibdev = queue->device->dev;
+	int i;
+
+	if (queue->bounce_mr)
+		ib_dereg_mr(queue->bounce_mr);
+	for (i = 0; i < queue->nr_bounce; i++) {
+		ib_dma_unmap_page(ibdev, queue->bounce_dma[i], PAGE_SIZE,
+				DMA_FROM_DEVICE);
+		__free_page(queue->bounce_pages[i]);
+	}
+	kfree(queue->bounce_dma);
+	kfree(queue->bounce_pages);
+
+	queue->bounce_mr = NULL;
+	queue->bounce_pages = NULL;
+	queue->bounce_dma = NULL;
+	queue->nr_bounce = 0;
+}
+
+static int nvme_rdma_alloc_bounce(struct nvme_rdma_queue *queue)
+{
+	struct ib_device *ibdev = queue->device->dev;
+	int nr = queue->queue_size, i;
+
+	if (!small_read_size || !nvme_rdma_queue_idx(queue) ||
+	    nr > ibdev->attrs.max_fast_reg_page_list_len)
+		return 0;
+
+	queue->bounce_pages = kcalloc(nr, sizeof(*queue->bounce_pages),
+			GFP_KERNEL);
+	queue->bounce_dma = kcalloc(nr, sizeof(*queue->bounce_dma),
+			GFP_KERNEL);
+	if (!queue->bounce_pages || !queue->bounce_dma)
+		goto out_free;
+
+	for (i = 0; i < nr; i++) {
+		struct page *page = alloc_page(GFP_KERNEL);
+		u64 dma;
+
+		if (!page)
+			goto out_free;
+
+		dma = ib_dma_map_page(ibdev, page, 0, PAGE_SIZE,
+				DMA_FROM_DEVICE);
+		if (ib_dma_mapping_error(ibdev, dma)) {
+			__free_page(page);
+			goto out_free;
+		}
+
+		queue->bounce_pages[i] = page;
+		queue->bounce_dma[i] = dma;
+		queue->nr_bounce++;
+	}
+
+	queue->bounce_mr = ib_alloc_mr(queue->device->pd, IB_MR_TYPE_MEM_REG,
+			nr);
+	if (IS_ERR(queue->bounce_mr)) {
+		queue->bounce_mr = NULL;
+		goto out_free;
+	}
+
+	return 0;
+
+out_free:
+	nvme_rdma_free_bounce(queue);
+	return -ENOMEM;
+}
+
+/*
+ * Queues on the same completion vector share CQs, across all controllers
+ * using the device, which keeps the number of CQs and interrupt sources
+ * independent of the number of controllers.  A new CQ is only allocated
+ * once the existing ones on the vector are fully reserved.  The CQs are
+ * created with ib_create_cq() and reaped by us rather than the RDMA core, so
+ * that work generated by a run of completions can be posted in one go, see
+ * nvme_rdma_process_cq().
+ */
+static struct nvme_rdma_cq *nvme_rdma_cq_get(struct nvme_rdma_device *dev,
+		int comp_vector, int nr_cqe)
+{
+	struct ib_cq_init_attr cq_attr = {
+		.comp_vector = comp_vector,
+	};
+	struct nvme_rdma_cq *cq;
+
+	if (nr_cqe > dev->dev->attrs.max_cqe)
+		return ERR_PTR(-EINVAL);
+
+	mutex_lock(&dev->cq_mutex);
+	list_for_each_entry(cq, &dev->cq_list, entry) {
+		if (cq->comp_vector == comp_vector &&
+		    cq->nr_cqe - cq->used_cqe >= nr_cqe)
+			goto found;
+	}
+
+	cq = kzalloc(sizeof(*cq), GFP_KERNEL);
+	if (!cq) {
+		cq = ERR_PTR(-ENOMEM);
+		goto out_unlock;
+	}
+
+	cq_attr.cqe = min(max(nr_cqe, NVME_RDMA_CQ_POOL_SIZE),
+			  dev->dev->attrs.max_cqe);
+	cq->cq = ib_create_cq(dev->dev, nvme_rdma_cq_event, NULL, cq,
+			&cq_attr);
+	if (IS_ERR(cq->cq)) {
+		int ret = PTR_ERR(cq->cq);
+
+		kfree(cq);
+		cq = ERR_PTR(ret);
+		goto out_unlock;
+	}
+	cq->comp_vector = comp_vector;
+	cq->nr_cqe = cq_attr.cqe;
+	spin_lock_init(&cq->lock);
+	irq_poll_init(&cq->iop, NVME_RDMA_POLL_BUDGET, nvme_rdma_iop_poll);
+	ib_req_notify_cq(cq->cq, IB_CQ_NEXT_COMP);
+	list_add_tail(&cq->entry, &dev->cq_list);
+found:
+	cq->used_cqe += nr_cqe;
+out_unlock:
+	mutex_unlock(&dev->cq_mutex);
+	return cq;
+}
+
+static void nvme_rdma_cq_put(struct nvme_rdma_device *dev,
+		struct nvme_rdma_cq *cq, int nr_cqe)
+{
+	mutex_lock(&dev->cq_mutex);
+	cq->used_cqe -= nr_cqe;
+	if (!cq->used_cqe) {
+		list_del(&cq->entry);
+		irq_poll_disable(&cq->iop);
+		ib_destroy_cq(cq->cq);
+		kfree(cq);
+	}
+	mutex_unlock(&dev->cq_mutex);
+}
+
 static void nvme_rdma_destroy_queue_ib(struct nvme_rdma_queue *queue)
 {
 	struct nvme_rdma_device *dev;
@@ -451,7 +802,9 @@ static void nvme_rdma_destroy_queue_ib(struct nvme_rdma_queue *queue)
 	dev = queue->device;
 	ibdev = dev->dev;
 	rdma_destroy_qp(queue->cm_id);
-	ib_free_cq(queue->ib_cq);
+	nvme_rdma_cq_put(dev, queue->cq, queue->nr_cqe);
+
+	nvme_rdma_free_bounce(queue);
 
 	nvme_rdma_free_ring(ibdev, queue->rsp_ring, queue->queue_size,
 			sizeof(struct nvme_completion), DMA_FROM_DEVICE);
@@ -462,7 +815,7 @@ static void nvme_rdma_destroy_queue_ib(struct nvme_rdma_queue *queue)
 static int nvme_rdma_create_queue_ib(struct nvme_rdma_queue *queue)
 {
 	struct ib_device *ibdev;
-	const int send_wr_factor = 3;			/* MR, SEND, INV */
+	const int send_wr_factor = nvme_rdma_send_wr_factor(queue);
 	const int cq_factor = send_wr_factor + 1;	/* + RECV */
 	int comp_vector, idx = nvme_rdma_queue_idx(queue);
 	int ret;
@@ -486,13 +839,14 @@ static int nvme_rdma_create_queue_ib(struct nvme_rdma_queue *queue)
 
 
 	/* +1 for ib_stop_cq */
-	queue->ib_cq = ib_alloc_cq(ibdev, queue,
-				cq_factor * queue->queue_size + 1,
-				comp_vector, IB_POLL_SOFTIRQ);
-	if (IS_ERR(queue->ib_cq)) {
-		ret = PTR_ERR(queue->ib_cq);
+	queue->nr_cqe = cq_factor * queue->queue_size + 1;
+	queue->cq = nvme_rdma_cq_get(queue->device, comp_vector,
+			queue->nr_cqe);
+	if (IS_ERR(queue->cq)) {
+		ret = PTR_ERR(queue->cq);
 		goto out_put_dev;
 	}
+	queue->ib_cq = queue->cq->cq;
 
 	ret = nvme_rdma_create_qp(queue, send_wr_factor);
 	if (ret)
@@ -505,17 +859,56 @@ static int nvme_rdma_create_queue_ib(struct nvme_rdma_queue *queue)
 		goto out_destroy_qp;
 	}
 
+	ret = nvme_rdma_alloc_bounce(queue);
+	if (ret)
+		goto out_free_ring;
+
 	return 0;
 
+out_free_ring:
+	nvme_rdma_free_ring(ibdev, queue->rsp_ring, queue->queue_size,
+			sizeof(struct nvme_completion), DMA_FROM_DEVICE);
 out_destroy_qp:
 	ib_destroy_qp(queue->qp);
 out_destroy_ib_cq:
-	ib_free_cq(queue->ib_cq);
+	nvme_rdma_cq_put(queue->device, queue->cq, queue->nr_cqe);
 out_put_dev:
 	nvme_rdma_dev_put(queue->device);
 	return ret;
 }
 
+/*
+ * Unsignalled sends only release their send queue slots once a later
+ * signalled WR completes, so we must signal before the SQ fills up.  Give
+ * each CPU that can submit to this queue an equal share of half the SQ,
+ * leaving the other half for WRs posted while the signalled completion is
+ * in flight.  I/O queues are mostly submitted to from the CPUs mapped to
+ * their hctx, counted from the tag set's CPU map once there is one, plus
+ * one for a requeue or connect from elsewhere.  Until then, and for the
+ * admin queue, assume every CPU can submit.
+ */
+static void nvme_rdma_init_sig_limit(struct nvme_rdma_queue *queue, int idx)
+{
+	struct nvme_rdma_ctrl *ctrl = queue->ctrl;
+	unsigned int sq_wrs = nvme_rdma_send_wr_factor(queue) * queue->queue_size;
+	unsigned int nr_cpus = num_possible_cpus();
+	int cpu;
+
+	if (idx && ctrl->ctrl.tagset) {
+		unsigned int hctx = (idx - 1) % nvme_rdma_nr_hw_queues(ctrl);
+
+		nr_cpus = 1;
+		for_each_possible_cpu(cpu)
+			if (ctrl->tag_set.mq_map[cpu] == hctx)
+				nr_cpus++;
+	}
+
+	queue->sig_limit = max(sq_wrs / 2 / nr_cpus, 1U);
+
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(queue->unsignaled_wrs, cpu) = 0;
+}
+
 static int nvme_rdma_alloc_queue(struct nvme_rdma_ctrl *ctrl,
 		int idx, size_t queue_size)
 {
@@ -533,7 +926,20 @@ static int nvme_rdma_alloc_queue(struct nvme_rdma_ctrl *ctrl,
 		queue->cmnd_capsule_len = sizeof(struct nvme_command);
 
 	queue->queue_size = queue_size;
-	atomic_set(&queue->sig_count, 0);
+
+	/* statistics survive reconnects, they are freed with the controller */
+	if (!queue->stats) {
+		queue->stats = alloc_percpu(struct nvme_rdma_queue_stats);
+		if (!queue->stats)
+			return -ENOMEM;
+	}
+
+	if (!queue->unsignaled_wrs) {
+		queue->unsignaled_wrs = alloc_percpu(unsigned int);
+		if (!queue->unsignaled_wrs)
+			return -ENOMEM;
+	}
+	nvme_rdma_init_sig_limit(queue, idx);
 
 	queue->cm_id = rdma_create_id(&init_net, nvme_rdma_cm_handler, queue,
 			RDMA_PS_TCP, IB_QPT_RC);
@@ -564,6 +970,7 @@ static int nvme_rdma_alloc_queue(struct nvme_rdma_ctrl *ctrl,
 	}
 
 	clear_bit(NVME_RDMA_Q_DELETING, &queue->flags);
+	clear_bit(NVME_RDMA_Q_DRAINING, &queue->flags);
 
 	return 0;
 
@@ -572,13 +979,82 @@ out_destroy_cm_id:
 	return ret;
 }
 
+struct nvme_rdma_drain {
+	struct ib_cqe		cqe;
+	struct completion	done;
+};
+
+static void nvme_rdma_drain_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+	struct nvme_rdma_drain *drain =
+		container_of(wc->wr_cqe, struct nvme_rdma_drain, cqe);
+
+	complete(&drain->done);
+}
+
+/*
+ * ib_drain_qp() would reap our shared CQ itself, racing with its irq_poll
+ * and the pollers of other queues, any of which may still be handling WCs of
+ * this QP after the drain returned.  Instead flush the QP and let the CQ's
+ * reapers get to a marker WR on both work queues, then wait for the reaper
+ * that found them to finish its batch.
+ *
+ * Reapers stop reposting receives and posting LOCAL_INVs for the queue once
+ * NVME_RDMA_Q_DRAINING is set: anything posted behind the markers would be
+ * flushed into the CQ after we returned, and the CQ outlives the QP and its
+ * rsp_ring.  Cycling the CQ lock first makes sure that a reaper which
+ * missed the flag has posted before the QP goes to the error state.
+ */
+static void nvme_rdma_drain_qp(struct nvme_rdma_queue *queue)
+{
+	struct ib_qp_attr attr = { .qp_state = IB_QPS_ERR };
+	struct nvme_rdma_drain sdrain, rdrain;
+	struct ib_send_wr swr = {}, *bad_swr;
+	struct ib_recv_wr rwr = {}, *bad_rwr;
+	int ret;
+
+	set_bit(NVME_RDMA_Q_DRAINING, &queue->flags);
+	spin_lock_bh(&queue->cq->lock);
+	spin_unlock_bh(&queue->cq->lock);
+
+	ret = ib_modify_qp(queue->qp, &attr, IB_QP_STATE);
+	if (ret) {
+		WARN_ONCE(ret, "failed to drain queue: %d\n", ret);
+		return;
+	}
+
+	sdrain.cqe.done = nvme_rdma_drain_done;
+	init_completion(&sdrain.done);
+	swr.wr_cqe = &sdrain.cqe;
+	swr.opcode = IB_WR_RDMA_WRITE;
+	swr.send_flags = IB_SEND_SIGNALED;
+	ret = ib_post_send(queue->qp, &swr, &bad_swr);
+	if (ret) {
+		WARN_ONCE(ret, "failed to drain send queue: %d\n", ret);
+		return;
+	}
+
+	rdrain.cqe.done = nvme_rdma_drain_done;
+	init_completion(&rdrain.done);
+	rwr.wr_cqe = &rdrain.cqe;
+	ret = ib_post_recv(queue->qp, &rwr, &bad_rwr);
+	if (ret)
+		WARN_ONCE(ret, "failed to drain recv queue: %d\n", ret);
+	else
+		wait_for_completion(&rdrain.done);
+	wait_for_completion(&sdrain.done);
+
+	spin_lock_bh(&queue->cq->lock);
+	spin_unlock_bh(&queue->cq->lock);
+}
+
 static void nvme_rdma_stop_queue(struct nvme_rdma_queue *queue)
 {
 	if (!test_and_clear_bit(NVME_RDMA_Q_LIVE, &queue->flags))
 		return;
 
 	rdma_disconnect(queue->cm_id);
-	ib_drain_qp(queue->qp);
+	nvme_rdma_drain_qp(queue);
 }
 
 static void nvme_rdma_free_queue(struct nvme_rdma_queue *queue)
@@ -644,20 +1120,31 @@ out_stop_queues:
 static int nvme_rdma_alloc_io_queues(struct nvme_rdma_ctrl *ctrl)
 {
 	struct nvmf_ctrl_options *opts = ctrl->ctrl.opts;
-	unsigned int nr_io_queues;
+	unsigned int nr_io_queues, nr_write_queues, nr_queues;
 	int i, ret;
 
 	nr_io_queues = min(opts->nr_io_queues, num_online_cpus());
-	ret = nvme_set_queue_count(&ctrl->ctrl, &nr_io_queues);
+	nr_write_queues = min(opts->nr_write_queues, nr_io_queues);
+	nr_queues = nr_io_queues + nr_write_queues;
+	ret = nvme_set_queue_count(&ctrl->ctrl, &nr_queues);
 	if (ret)
 		return ret;
 
-	ctrl->ctrl.queue_count = nr_io_queues + 1;
+	/* if the target granted fewer queues give up write queues first */
+	if (nr_queues < nr_io_queues + nr_write_queues) {
+		nr_io_queues = min(nr_io_queues, nr_queues);
+		nr_write_queues = min(nr_write_queues,
+				nr_queues - nr_io_queues);
+	}
+
+	ctrl->nr_write_queues = nr_write_queues;
+	ctrl->ctrl.queue_count = nr_io_queues + nr_write_queues + 1;
 	if (ctrl->ctrl.queue_count < 2)
 		return 0;
 
 	dev_info(ctrl->ctrl.device,
-		"creating %d I/O queues.\n", nr_io_queues);
+		"creating %d I/O queues (%d write).\n",
+		nr_io_queues + nr_write_queues, nr_write_queues);
 
 	for (i = 1; i < ctrl->ctrl.queue_count; i++) {
 		ret = nvme_rdma_alloc_queue(ctrl, i,
@@ -715,7 +1202,7 @@ static struct blk_mq_tag_set *nvme_rdma_alloc_tagset(struct nvme_ctrl *nctrl,
 		set->cmd_size = sizeof(struct nvme_rdma_request) +
 			SG_CHUNK_SIZE * sizeof(struct scatterlist);
 		set->driver_data = ctrl;
-		set->nr_hw_queues = nctrl->queue_count - 1;
+		set->nr_hw_queues = nvme_rdma_nr_hw_queues(ctrl);
 		set->timeout = NVME_IO_TIMEOUT;
 	}
 
@@ -768,6 +1255,10 @@ static int nvme_rdma_configure_admin_queue(struct nvme_rdma_ctrl *ctrl,
 	ctrl->max_fr_pages = min_t(u32, NVME_RDMA_MAX_SEGMENTS,
 		ctrl->device->dev->attrs.max_fast_reg_page_list_len);
 
+	ctrl->ctrl.pi_offload = pi_offload &&
+		(ctrl->device->dev->attrs.device_cap_flags &
+		 IB_DEVICE_SIGNATURE_HANDOVER);
+
 	if (new) {
 		ctrl->ctrl.admin_tagset = nvme_rdma_alloc_tagset(&ctrl->ctrl, true);
 		if (IS_ERR(ctrl->ctrl.admin_tagset))
@@ -842,7 +1333,7 @@ static void nvme_rdma_destroy_io_queues(struct nvme_rdma_ctrl *ctrl,
 
 static int nvme_rdma_configure_io_queues(struct nvme_rdma_ctrl *ctrl, bool new)
 {
-	int ret;
+	int ret, i;
 
 	ret = nvme_rdma_alloc_io_queues(ctrl);
 	if (ret)
@@ -864,9 +1355,13 @@ static int nvme_rdma_configure_io_queues(struct nvme_rdma_ctrl *ctrl, bool new)
 			goto out_free_io_queues;
 
 		blk_mq_update_nr_hw_queues(&ctrl->tag_set,
-			ctrl->ctrl.queue_count - 1);
+			nvme_rdma_nr_hw_queues(ctrl));
 	}
 
+	/* now that the CPU to hctx map is known */
+	for (i = 1; i < ctrl->ctrl.queue_count; i++)
+		nvme_rdma_init_sig_limit(&ctrl->queues[i], i);
+
 	ret = nvme_rdma_start_io_queues(ctrl);
 	if (ret)
 		goto out_cleanup_connect_q;
@@ -884,6 +1379,18 @@ out_free_io_queues:
 	return ret;
 }
 
+static void nvme_rdma_free_queues_mem(struct nvme_rdma_ctrl *ctrl)
+{
+	struct nvmf_ctrl_options *opts = ctrl->ctrl.opts;
+	int i;
+
+	for (i = 0; i < opts->nr_io_queues + opts->nr_write_queues + 1; i++) {
+		free_percpu(ctrl->queues[i].unsignaled_wrs);
+		free_percpu(ctrl->queues[i].stats);
+	}
+	kfree(ctrl->queues);
+}
+
 static void nvme_rdma_free_ctrl(struct nvme_ctrl *nctrl)
 {
 	struct nvme_rdma_ctrl *ctrl = to_rdma_ctrl(nctrl);
@@ -895,7 +1402,7 @@ static void nvme_rdma_free_ctrl(struct nvme_ctrl *nctrl)
 	list_del(&ctrl->list);
 	mutex_unlock(&nvme_rdma_ctrl_mutex);
 
-	kfree(ctrl->queues);
+	nvme_rdma_free_queues_mem(ctrl);
 	nvmf_free_options(nctrl->opts);
 free_ctrl:
 	kfree(ctrl);
@@ -1004,9 +1511,10 @@ static void nvme_rdma_error_recovery(struct nvme_rdma_ctrl *ctrl)
 static void nvme_rdma_wr_error(struct ib_cq *cq, struct ib_wc *wc,
 		const char *op)
 {
-	struct nvme_rdma_queue *queue = cq->cq_context;
+	struct nvme_rdma_queue *queue = nvme_rdma_wc_queue(wc);
 	struct nvme_rdma_ctrl *ctrl = queue->ctrl;
 
+	nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_WR_ERROR);
 	if (ctrl->ctrl.state == NVME_CTRL_LIVE)
 		dev_info(ctrl->ctrl.device,
 			     "%s for CQE 0x%p failed with status %s (%d)\n",
@@ -1027,22 +1535,67 @@ static void nvme_rdma_inv_rkey_done(struct ib_cq *cq, struct ib_wc *wc)
 		nvme_rdma_wr_error(cq, wc, "LOCAL_INV");
 }
 
+/*
+ * Returns the first WR of the invalidation chain, which always ends in
+ * req->inv_wr.  The signature MR sits on top of the data MR, so it has to
+ * be invalidated first.
+ */
+static struct ib_send_wr *nvme_rdma_prep_inv_wr(struct nvme_rdma_queue *queue,
+		struct nvme_rdma_request *req)
+{
+	struct ib_send_wr *wr = &req->inv_wr;
+
+	memset(wr, 0, sizeof(*wr));
+	wr->opcode = IB_WR_LOCAL_INV;
+	wr->ex.invalidate_rkey = req->mr->rkey;
+	req->reg_cqe.done = nvme_rdma_inv_rkey_done;
+	wr->wr_cqe = &req->reg_cqe;
+
+	req->mr->need_inval = false;
+	nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_LOCAL_INV);
+
+	if (req->use_sig_mr) {
+		struct ib_send_wr *sig_wr = &req->sig_inv_wr;
+
+		memset(sig_wr, 0, sizeof(*sig_wr));
+		sig_wr->opcode = IB_WR_LOCAL_INV;
+		sig_wr->ex.invalidate_rkey = req->sig_mr->rkey;
+		sig_wr->wr_cqe = &req->reg_cqe;
+		sig_wr->next = wr;
+		nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_LOCAL_INV);
+		return sig_wr;
+	}
+
+	return wr;
+}
+
 static int nvme_rdma_inv_rkey(struct nvme_rdma_queue *queue,
 		struct nvme_rdma_request *req)
 {
 	struct ib_send_wr *bad_wr;
-	struct ib_send_wr wr = {
-		.opcode		    = IB_WR_LOCAL_INV,
-		.next		    = NULL,
-		.num_sge	    = 0,
-		.send_flags	    = 0,
-		.ex.invalidate_rkey = req->mr->rkey,
-	};
 
-	req->reg_cqe.done = nvme_rdma_inv_rkey_done;
-	wr.wr_cqe = &req->reg_cqe;
+	return ib_post_send(queue->qp, nvme_rdma_prep_inv_wr(queue, req),
+			&bad_wr);
+}
 
-	return ib_post_send(queue->qp, &wr, &bad_wr);
+static void nvme_rdma_copy_bounce(struct nvme_rdma_queue *queue,
+		struct request *rq)
+{
+	struct ib_device *ibdev = queue->device->dev;
+	u64 dma = queue->bounce_dma[rq->tag];
+	void *src = page_address(queue->bounce_pages[rq->tag]);
+	struct req_iterator iter;
+	struct bio_vec bv;
+
+	ib_dma_sync_single_for_cpu(ibdev, dma, PAGE_SIZE, DMA_FROM_DEVICE);
+	rq_for_each_segment(bv, rq, iter) {
+		void *dst = kmap_atomic(bv.bv_page);
+
+		memcpy(dst + bv.bv_offset, src, bv.bv_len);
+		kunmap_atomic(dst);
+		src += bv.bv_len;
+	}
+	ib_dma_sync_single_for_device(ibdev, dma, PAGE_SIZE, DMA_FROM_DEVICE);
 }
 
 static void nvme_rdma_unmap_data(struct nvme_rdma_queue *queue,
@@ -1057,6 +1610,12 @@ static void nvme_rdma_unmap_data(struct nvme_rdma_queue *queue,
 	if (!blk_rq_bytes(rq))
 		return;
 
+	if (req->bounce) {
+		nvme_rdma_copy_bounce(queue, rq);
+		nvme_cleanup_cmd(rq);
+		return;
+	}
+
 	if (req->mr->need_inval) {
 		res = nvme_rdma_inv_rkey(queue, req);
 		if (unlikely(res < 0)) {
@@ -1101,6 +1660,7 @@ static int nvme_rdma_map_sg_inline(struct nvme_rdma_queue *queue,
 
 	req->inline_data = true;
 	req->num_sge++;
+	nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_MAP_INLINE);
 	return 0;
 }
 
@@ -1113,6 +1673,7 @@ static int nvme_rdma_map_sg_single(struct nvme_rdma_queue *queue,
 	put_unaligned_le24(sg_dma_len(req->sg_table.sgl), sg->length);
 	put_unaligned_le32(queue->device->pd->unsafe_global_rkey, sg->key);
 	sg->type = NVME_KEY_SGL_FMT_DATA_DESC << 4;
+	nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_MAP_SINGLE);
 	return 0;
 }
 
@@ -1151,6 +1712,118 @@ static int nvme_rdma_map_sg_fr(struct nvme_rdma_queue *queue,
 	sg->type = (NVME_KEY_SGL_FMT_DATA_DESC << 4) |
 			NVME_SGL_FMT_INVALIDATE;
 
+	nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_MAP_FR);
+	return 0;
+}
+
+static inline bool nvme_rdma_use_bounce(struct nvme_rdma_queue *queue,
+		struct request *rq)
+{
+	return queue->bounce_mr && req_op(rq) == REQ_OP_READ &&
+		blk_rq_payload_bytes(rq) <= small_read_size &&
+		rq->tag < queue->nr_bounce;
+}
+
+static int nvme_rdma_map_bounce(struct nvme_rdma_queue *queue,
+		struct nvme_rdma_request *req, struct request *rq,
+		struct nvme_command *c)
+{
+	struct nvme_keyed_sgl_desc *sg = &c->common.dptr.ksgl;
+
+	sg->addr = cpu_to_le64(queue->bounce_mr->iova +
+			(u64)rq->tag * PAGE_SIZE);
+	put_unaligned_le24(blk_rq_payload_bytes(rq), sg->length);
+	put_unaligned_le32(queue->bounce_mr->rkey, sg->key);
+	sg->type = NVME_KEY_SGL_FMT_DATA_DESC << 4;
+
+	req->bounce = true;
+	nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_MAP_BOUNCE);
+	return 0;
+}
+
+/* check_mask bits of struct ib_sig_attrs, one per byte of the PI tuple */
+#define NVME_RDMA_CHECK_GUARD		0xc0
+#define NVME_RDMA_CHECK_REFTAG		0x0f
+
+static bool nvme_rdma_use_pi(struct nvme_rdma_request *req,
+		struct request *rq)
+{
+	struct nvme_ns *ns = rq->q->queuedata;
+
+	if (!req->sig_mr || !ns || !ns->pi_type || !ns->ext ||
+	    ns->ms != sizeof(struct t10_pi_tuple))
+		return false;
+	if (blk_rq_is_passthrough(rq) || blk_integrity_rq(rq))
+		return false;
+	return req_op(rq) == REQ_OP_READ || req_op(rq) == REQ_OP_WRITE;
+}
+
+/*
+ * The host buffer only holds data, on the wire each block is followed by its
+ * PI tuple.  A signature MR layered over the fast registered data MR lets
+ * the HCA insert the PI on writes and check and strip it on reads, taking
+ * over from the controller what PRACT would otherwise make it do.
+ */
+static int nvme_rdma_map_pi(struct nvme_rdma_queue *queue,
+		struct nvme_rdma_request *req, struct request *rq,
+		struct nvme_command *c, int count)
+{
+	struct nvme_ns *ns = rq->q->queuedata;
+	struct nvme_keyed_sgl_desc *sg = &c->common.dptr.ksgl;
+	struct ib_sig_attrs *attrs = &req->sig_attrs;
+	struct ib_t10_dif_domain *dif = &attrs->wire.sig.dif;
+	u16 control = le16_to_cpu(c->rw.control);
+	u32 length;
+	int ret;
+
+	ret = nvme_rdma_map_sg_fr(queue, req, c, count);
+	if (ret)
+		return ret;
+
+	memset(attrs, 0, sizeof(*attrs));
+	attrs->mem.sig_type = IB_SIG_TYPE_NONE;
+	attrs->wire.sig_type = IB_SIG_TYPE_T10_DIF;
+	dif->bg_type = IB_T10DIF_CRC;
+	dif->pi_interval = 1 << ns->lba_shift;
+	dif->app_escape = true;
+	if (control & NVME_RW_PRINFO_PRCHK_GUARD)
+		attrs->check_mask |= NVME_RDMA_CHECK_GUARD;
+	if (control & NVME_RW_PRINFO_PRCHK_REF) {
+		dif->ref_tag = le32_to_cpu(c->rw.reftag);
+		dif->ref_remap = true;
+		attrs->check_mask |= NVME_RDMA_CHECK_REFTAG;
+	} else {
+		dif->ref_escape = true;
+	}
+
+	c->rw.control = cpu_to_le16(control & ~NVME_RW_PRINFO_PRACT);
+
+	ib_update_fast_reg_key(req->sig_mr, ib_inc_rkey(req->sig_mr->rkey));
+
+	req->sig_data_sge.addr = req->mr->iova;
+	req->sig_data_sge.length = req->mr->length;
+	req->sig_data_sge.lkey = req->mr->lkey;
+
+	memset(&req->sig_wr, 0, sizeof(req->sig_wr));
+	req->sig_wr.wr.opcode = IB_WR_REG_SIG_MR;
+	req->sig_wr.wr.wr_cqe = &req->reg_cqe;
+	req->sig_wr.wr.sg_list = &req->sig_data_sge;
+	req->sig_wr.wr.num_sge = 1;
+	req->sig_wr.sig_attrs = attrs;
+	req->sig_wr.sig_mr = req->sig_mr;
+	req->sig_wr.access_flags = IB_ACCESS_LOCAL_WRITE |
+				   IB_ACCESS_REMOTE_READ |
+				   IB_ACCESS_REMOTE_WRITE;
+	req->reg_wr.wr.next = &req->sig_wr.wr;
+
+	/* we invalidate both MRs ourselves, so no SEND_WITH_INV */
+	length = req->mr->length + (req->mr->length >> ns->lba_shift) * ns->ms;
+	sg->addr = 0;
+	put_unaligned_le24(length, sg->length);
+	put_unaligned_le32(req->sig_mr->rkey, sg->key);
+	sg->type = NVME_KEY_SGL_FMT_DATA_DESC << 4;
+
+	nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_MAP_PI);
 	return 0;
 }
 
@@ -1164,6 +1837,8 @@ static int nvme_rdma_map_data(struct nvme_rdma_queue *queue,
 
 	req->num_sge = 1;
 	req->inline_data = false;
+	req->bounce = false;
+	req->use_sig_mr = false;
 	req->mr->need_inval = false;
 
 	c->common.flags |= NVME_CMD_SGL_METABUF;
@@ -1171,6 +1846,10 @@ static int nvme_rdma_map_data(struct nvme_rdma_queue *queue,
 	if (!blk_rq_bytes(rq))
 		return nvme_rdma_set_sg_null(c);
 
+	req->use_sig_mr = nvme_rdma_use_pi(req, rq);
+	if (!req->use_sig_mr && nvme_rdma_use_bounce(queue, rq))
+		return nvme_rdma_map_bounce(queue, req, rq, c);
+
 	req->sg_table.sgl = req->first_sgl;
 	ret = sg_alloc_table_chained(&req->sg_table,
 			blk_rq_nr_phys_segments(rq), req->sg_table.sgl);
@@ -1186,6 +1865,9 @@ static int nvme_rdma_map_data(struct nvme_rdma_queue *queue,
 		return -EIO;
 	}
 
+	if (req->use_sig_mr)
+		return nvme_rdma_map_pi(queue, req, rq, c, count);
+
 	if (count == 1) {
 		if (rq_data_dir(rq) == WRITE && nvme_rdma_queue_idx(queue) &&
 		    blk_rq_payload_bytes(rq) <=
@@ -1206,15 +1888,25 @@ static void nvme_rdma_send_done(struct ib_cq *cq, struct ib_wc *wc)
 }
 
 /*
- * We want to signal completion at least every queue depth/2.  This returns the
- * largest power of two that is not above half of (queue size + 1) to optimize
- * (avoid divisions).
+ * Account @nr_wrs send queue slots to this CPU and return true once its
+ * share of the SQ is used up, in which case the caller must signal the
+ * send.  A fast registered command is charged for its LOCAL_INV up front
+ * as that is posted from the completion path.
  */
-static inline bool nvme_rdma_queue_sig_limit(struct nvme_rdma_queue *queue)
+static inline bool nvme_rdma_queue_sig_limit(struct nvme_rdma_queue *queue,
+		unsigned int nr_wrs, bool force)
 {
-	int limit = 1 << ilog2((queue->queue_size + 1) / 2);
+	unsigned int *unsignaled = get_cpu_ptr(queue->unsignaled_wrs);
+	bool signal = force;
 
-	return (atomic_inc_return(&queue->sig_count) & (limit - 1)) == 0;
+	*unsignaled += nr_wrs;
+	if (*unsignaled >= queue->sig_limit)
+		signal = true;
+	if (signal)
+		*unsignaled = 0;
+	put_cpu_ptr(queue->unsignaled_wrs);
+
+	return signal;
 }
 
 static int nvme_rdma_post_send(struct nvme_rdma_queue *queue,
@@ -1251,13 +1943,22 @@ static int nvme_rdma_post_send(struct nvme_rdma_queue *queue,
 	 * embedded in request's payload, is not freed when __ib_process_cq()
 	 * calls wr_cqe->done().
 	 */
-	if (nvme_rdma_queue_sig_limit(queue) || flush)
+	if (nvme_rdma_queue_sig_limit(queue,
+			first ? nvme_rdma_send_wr_factor(queue) : 1, flush)) {
 		wr.send_flags |= IB_SEND_SIGNALED;
+		nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_SEND_SIGNALED);
+	}
+	nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_SEND);
 
-	if (first)
-		first->next = &wr;
-	else
+	if (first) {
+		struct ib_send_wr *last = first;
+
+		while (last->next)
+			last = last->next;
+		last->next = &wr;
+	} else {
 		first = &wr;
+	}
 
 	ret = ib_post_send(queue->qp, first, &bad_wr);
 	if (unlikely(ret)) {
@@ -1267,6 +1968,24 @@ static int nvme_rdma_post_send(struct nvme_rdma_queue *queue,
 	return ret;
 }
 
+static void nvme_rdma_prep_recv_wr(struct nvme_rdma_queue *queue,
+		struct nvme_rdma_qe *qe, struct ib_recv_wr *wr,
+		struct ib_sge *list)
+{
+	list->addr   = qe->dma;
+	list->length = sizeof(struct nvme_completion);
+	list->lkey   = queue->device->pd->local_dma_lkey;
+
+	qe->cqe.done = nvme_rdma_recv_done;
+
+	wr->next     = NULL;
+	wr->wr_cqe   = &qe->cqe;
+	wr->sg_list  = list;
+	wr->num_sge  = 1;
+
+	nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_RECV_POSTED);
+}
+
 static int nvme_rdma_post_recv(struct nvme_rdma_queue *queue,
 		struct nvme_rdma_qe *qe)
 {
@@ -1274,17 +1993,7 @@ static int nvme_rdma_post_recv(struct nvme_rdma_queue *queue,
 	struct ib_sge list;
 	int ret;
 
-	list.addr   = qe->dma;
-	list.length = sizeof(struct nvme_completion);
-	list.lkey   = queue->device->pd->local_dma_lkey;
-
-	qe->cqe.done = nvme_rdma_recv_done;
-
-	wr.next     = NULL;
-	wr.wr_cqe   = &qe->cqe;
-	wr.sg_list  = &list;
-	wr.num_sge  = 1;
-
+	nvme_rdma_prep_recv_wr(queue, qe, &wr, &list);
 	ret = ib_post_recv(queue->qp, &wr, &bad_wr);
 	if (unlikely(ret)) {
 		dev_err(queue->ctrl->ctrl.device,
@@ -1322,8 +2031,145 @@ static void nvme_rdma_submit_async_event(struct nvme_ctrl *arg, int aer_idx)
 	WARN_ON_ONCE(ret);
 }
 
+static void nvme_rdma_flush_batch(struct nvme_rdma_cq_batch *batch)
+{
+	struct nvme_rdma_queue *queue = batch->queue;
+	struct ib_recv_wr *bad_recv_wr;
+	struct ib_send_wr *bad_wr;
+	bool draining;
+	int i, ret;
+
+	if (!queue)
+		return;
+
+	/* nothing may be posted behind nvme_rdma_drain_qp()'s markers */
+	draining = test_bit(NVME_RDMA_Q_DRAINING, &queue->flags);
+	if (unlikely(draining))
+		batch->nr_recv = 0;
+
+	if (batch->nr_recv) {
+		ret = ib_post_recv(queue->qp, batch->recv_wr, &bad_recv_wr);
+		if (unlikely(ret)) {
+			dev_err(queue->ctrl->ctrl.device,
+				"Reposting %d receives failed (%d)\n",
+				batch->nr_recv, ret);
+		}
+		batch->nr_recv = 0;
+	}
+
+	if (!batch->nr)
+		return;
+
+	/* the QP is being moved to the error state, which fences its rkeys */
+	if (batch->inv_first && !draining) {
+		ret = ib_post_send(queue->qp, batch->inv_first, &bad_wr);
+		if (unlikely(ret)) {
+			dev_err(queue->ctrl->ctrl.device,
+				"Queueing INV WRs failed (%d)\n", ret);
+			nvme_rdma_error_recovery(queue->ctrl);
+		}
+	}
+
+	for (i = 0; i < batch->nr; i++)
+		blk_mq_complete_request(batch->rqs[i]);
+
+	batch->inv_first = NULL;
+	batch->inv_last = NULL;
+	batch->nr = 0;
+}
+
+/*
+ * Responses reaped in one go are completed together once the whole batch
+ * has been processed.  Instead of posting a LOCAL_INV for every request from
+ * ->complete, their invalidations are chained and posted with a single
+ * doorbell just before that.  The request is still only completed after its
+ * LOCAL_INV has been posted, so the rkey is never exposed for longer than
+ * before.
+ */
+static void nvme_rdma_batch_rsp(struct nvme_rdma_queue *queue,
+		struct nvme_rdma_cq_batch *batch, struct request *rq,
+		struct nvme_completion *cqe)
+{
+	struct nvme_rdma_request *req = blk_mq_rq_to_pdu(rq);
+
+	nvme_req(rq)->status = le16_to_cpu(cqe->status) >> 1;
+	nvme_req(rq)->result = cqe->result;
+
+	if (req->mr->need_inval) {
+		struct ib_send_wr *first = nvme_rdma_prep_inv_wr(queue, req);
+
+		if (batch->inv_last)
+			batch->inv_last->next = first;
+		else
+			batch->inv_first = first;
+		batch->inv_last = &req->inv_wr;
+	}
+	batch->rqs[batch->nr++] = rq;
+}
+
+/*
+ * Consumed receives are reposted as a single chained WR list once the batch
+ * is done, saving a receive doorbell per completion.
+ */
+static void nvme_rdma_batch_recv(struct nvme_rdma_queue *queue,
+		struct nvme_rdma_cq_batch *batch, struct nvme_rdma_qe *qe)
+{
+	int i = batch->nr_recv++;
+
+	nvme_rdma_prep_recv_wr(queue, qe, &batch->recv_wr[i],
+			&batch->recv_sge[i]);
+	if (i)
+		batch->recv_wr[i - 1].next = &batch->recv_wr[i];
+}
+
+/*
+ * PI errors found by the HCA are reported through the signature MR rather
+ * than the CQE, turn them into the NVMe status the controller would use.
+ */
+static void nvme_rdma_check_pi_status(struct nvme_rdma_queue *queue,
+		struct nvme_rdma_request *req, struct nvme_completion *cqe)
+{
+	struct ib_mr_status mr_status;
+	u16 status;
+	int ret;
+
+	ret = ib_check_mr_status(req->sig_mr, IB_MR_CHECK_SIG_STATUS,
+			&mr_status);
+	if (ret) {
+		dev_err(queue->ctrl->ctrl.device,
+			"ib_check_mr_status failed (%d)\n", ret);
+		return;
+	}
+
+	if (!(mr_status.fail_status & IB_MR_CHECK_SIG_STATUS))
+		return;
+
+	switch (mr_status.sig_err.err_type) {
+	case IB_SIG_BAD_GUARD:
+		status = NVME_SC_GUARD_CHECK;
+		break;
+	case IB_SIG_BAD_REFTAG:
+		status = NVME_SC_REFTAG_CHECK;
+		break;
+	case IB_SIG_BAD_APPTAG:
+	default:
+		status = NVME_SC_APPTAG_CHECK;
+		break;
+	}
+
+	dev_err(queue->ctrl->ctrl.device,
+		"PI error %#x at offset %llu: expected %#x, actual %#x\n",
+		status, mr_status.sig_err.sig_err_offset,
+		mr_status.sig_err.expected, mr_status.sig_err.actual);
+	nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_PI_ERROR);
+
+	if (!(le16_to_cpu(cqe->status) >> 1))
+		cqe->status = cpu_to_le16(status << 1);
+}
+
 static int nvme_rdma_process_nvme_rsp(struct nvme_rdma_queue *queue,
-		struct nvme_completion *cqe, struct ib_wc *wc, int tag)
+		struct nvme_completion *cqe, struct ib_wc *wc, int tag,
+		struct nvme_rdma_cq_batch *batch)
 {
 	struct request *rq;
 	struct nvme_rdma_request *req;
@@ -1342,19 +2188,30 @@ static int nvme_rdma_process_nvme_rsp(struct nvme_rdma_queue *queue,
 	if (rq->tag == tag)
 		ret = 1;
 
+	if (unlikely(req->use_sig_mr))
+		nvme_rdma_check_pi_status(queue, req, cqe);
+
 	if ((wc->wc_flags & IB_WC_WITH_INVALIDATE) &&
-	    wc->ex.invalidate_rkey == req->mr->rkey)
+	    wc->ex.invalidate_rkey == req->mr->rkey) {
 		req->mr->need_inval = false;
+		nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_REMOTE_INV);
+	}
+
+	if (batch) {
+		nvme_rdma_batch_rsp(queue, batch, rq, cqe);
+		return ret;
+	}
 
 	nvme_end_request(rq, cqe->status, cqe->result);
 	return ret;
 }
 
-static int __nvme_rdma_recv_done(struct ib_cq *cq, struct ib_wc *wc, int tag)
+static int __nvme_rdma_recv_done(struct ib_cq *cq, struct ib_wc *wc, int tag,
+		struct nvme_rdma_cq_batch *batch)
 {
 	struct nvme_rdma_qe *qe =
 		container_of(wc->wr_cqe, struct nvme_rdma_qe, cqe);
-	struct nvme_rdma_queue *queue = cq->cq_context;
+	struct nvme_rdma_queue *queue = nvme_rdma_wc_queue(wc);
 	struct ib_device *ibdev = queue->device->dev;
 	struct nvme_completion *cqe = qe->data;
 	const size_t len = sizeof(struct nvme_completion);
@@ -1365,7 +2222,15 @@ static int __nvme_rdma_recv_done(struct ib_cq *cq, struct ib_wc *wc, int tag)
 		return 0;
 	}
 
-	ib_dma_sync_single_for_cpu(ibdev, qe->dma, len, DMA_FROM_DEVICE);
+	/* a batch only ever holds work for a single queue */
+	if (batch && batch->queue != queue) {
+		nvme_rdma_flush_batch(batch);
+		batch->queue = queue;
+	}
+
+	/* batched receives have been synced by nvme_rdma_prefetch_rsp() */
+	if (!batch)
+		ib_dma_sync_single_for_cpu(ibdev, qe->dma, len, DMA_FROM_DEVICE);
 	/*
 	 * AEN requests are special as they don't time out and can
 	 * survive any kind of queue freeze and often don't respond to
@@ -1377,16 +2242,179 @@ static int __nvme_rdma_recv_done(struct ib_cq *cq, struct ib_wc *wc, int tag)
 		nvme_complete_async_event(&queue->ctrl->ctrl, cqe->status,
 				&cqe->result);
 	else
-		ret = nvme_rdma_process_nvme_rsp(queue, cqe, wc, tag);
+		ret = nvme_rdma_process_nvme_rsp(queue, cqe, wc, tag, batch);
 	ib_dma_sync_single_for_device(ibdev, qe->dma, len, DMA_FROM_DEVICE);
 
-	nvme_rdma_post_recv(queue, qe);
+	if (batch)
+		nvme_rdma_batch_recv(queue, batch, qe);
+	else if (!test_bit(NVME_RDMA_Q_DRAINING, &queue->flags))
+		nvme_rdma_post_recv(queue, qe);
 	return ret;
 }
 
 static void nvme_rdma_recv_done(struct ib_cq *cq, struct ib_wc *wc)
 {
-	__nvme_rdma_recv_done(cq, wc, -1);
+	__nvme_rdma_recv_done(cq, wc, -1, NULL);
+}
+
+static inline bool nvme_rdma_wc_is_recv(struct ib_wc *wc)
+{
+	return wc->wr_cqe && wc->wr_cqe->done == nvme_rdma_recv_done &&
+		wc->status == IB_WC_SUCCESS;
+}
+
+/*
+ * Pull in the response capsules of a batch, then the PDUs of the requests
+ * they complete, so the cache misses overlap instead of being taken one
+ * completion at a time.
+ */
+static void nvme_rdma_prefetch_rsp(struct ib_wc *wcs, int nr)
+{
+	struct nvme_rdma_queue *queue;
+	struct nvme_rdma_qe *qe;
+	struct nvme_completion *cqe;
+	struct request *rq;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (!nvme_rdma_wc_is_recv(&wcs[i]))
+			continue;
+		queue = nvme_rdma_wc_queue(&wcs[i]);
+		qe = container_of(wcs[i].wr_cqe, struct nvme_rdma_qe, cqe);
+		ib_dma_sync_single_for_cpu(queue->device->dev, qe->dma,
+				sizeof(struct nvme_completion), DMA_FROM_DEVICE);
+		prefetch(qe->data);
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (!nvme_rdma_wc_is_recv(&wcs[i]))
+			continue;
+		queue = nvme_rdma_wc_queue(&wcs[i]);
+		qe = container_of(wcs[i].wr_cqe, struct nvme_rdma_qe, cqe);
+		cqe = qe->data;
+		if (nvme_rdma_queue_idx(queue) == 0 &&
+		    cqe->command_id >= NVME_RDMA_AQ_BLKMQ_DEPTH)
+			continue;
+		rq = blk_mq_tag_to_rq(nvme_rdma_tagset(queue), cqe->command_id);
+		if (rq)
+			prefetch(blk_mq_rq_to_pdu(rq));
+	}
+}
+
+/*
+ * Reap up to @budget completions from a (possibly shared) CQ, with the CQ's
+ * lock held.  @found is set if one of them completed request @tag on
+ * @poll_queue.
+ */
+static int nvme_rdma_process_cq(struct nvme_rdma_cq *ncq, int budget,
+		struct nvme_rdma_queue *poll_queue, int tag, int *found)
+{
+	struct nvme_rdma_cq_batch batch = { .nr = 0 };
+	struct ib_wc wcs[NVME_RDMA_POLL_BATCH];
+	struct ib_cq *cq = ncq->cq;
+	int completed = 0, nr, i;
+
+	while (completed < budget) {
+		nr = ib_poll_cq(cq, min(budget - completed,
+				NVME_RDMA_POLL_BATCH), wcs);
+		if (nr <= 0)
+			break;
+
+		nvme_rdma_prefetch_rsp(wcs, nr);
+
+		for (i = 0; i < nr; i++) {
+			struct ib_cqe *cqe = wcs[i].wr_cqe;
+
+			if (!cqe)
+				continue;
+
+			if (cqe->done == nvme_rdma_recv_done) {
+				if (__nvme_rdma_recv_done(cq, &wcs[i], tag,
+						&batch) &&
+				    nvme_rdma_wc_queue(&wcs[i]) == poll_queue)
+					*found = 1;
+			} else {
+				cqe->done(cq, &wcs[i]);
+			}
+		}
+
+		nvme_rdma_flush_batch(&batch);
+		completed += nr;
+		if (nr < NVME_RDMA_POLL_BATCH)
+			break;
+	}
+
+	return completed;
+}
+
+static int nvme_rdma_iop_poll(struct irq_poll *iop, int budget)
+{
+	struct nvme_rdma_cq *cq = container_of(iop, struct nvme_rdma_cq, iop);
+	int found = 0, completed;
+
+	spin_lock(&cq->lock);
+	completed = nvme_rdma_process_cq(cq, budget, NULL, -1, &found);
+	spin_unlock(&cq->lock);
+	if (completed < budget) {
+		irq_poll_complete(iop);
+		if (ib_req_notify_cq(cq->cq, IB_CQ_NEXT_COMP |
+				IB_CQ_REPORT_MISSED_EVENTS) > 0)
+			irq_poll_sched(iop);
+	}
+
+	return completed;
+}
+
+static void nvme_rdma_cq_event(struct ib_cq *cq, void *cq_context)
+{
+	struct nvme_rdma_cq *ncq = cq_context;
+
+	irq_poll_sched(&ncq->iop);
+}
+
+/*
+ * Register the small read buffers once for the lifetime of the connection.
+ * Later sends are ordered behind the REG_MR WR, so no need to wait for it.
+ */
+static int nvme_rdma_reg_bounce(struct nvme_rdma_queue *queue)
+{
+	struct ib_mr *mr = queue->bounce_mr;
+	struct ib_send_wr *bad_wr;
+	struct scatterlist *sgl;
+	struct ib_reg_wr wr;
+	int i, nr;
+
+	if (!mr)
+		return 0;
+
+	sgl = kcalloc(queue->nr_bounce, sizeof(*sgl), GFP_KERNEL);
+	if (!sgl)
+		return -ENOMEM;
+
+	sg_init_table(sgl, queue->nr_bounce);
+	for (i = 0; i < queue->nr_bounce; i++) {
+		sg_set_page(&sgl[i], queue->bounce_pages[i], PAGE_SIZE, 0);
+		sg_dma_address(&sgl[i]) = queue->bounce_dma[i];
+		sg_dma_len(&sgl[i]) = PAGE_SIZE;
+	}
+
+	nr = ib_map_mr_sg(mr, sgl, queue->nr_bounce, NULL, PAGE_SIZE);
+	kfree(sgl);
+	if (unlikely(nr < queue->nr_bounce))
+		return nr < 0 ? nr : -EINVAL;
+
+	ib_update_fast_reg_key(mr, ib_inc_rkey(mr->rkey));
+
+	queue->bounce_reg_cqe.done = nvme_rdma_memreg_done;
+	memset(&wr, 0, sizeof(wr));
+	wr.wr.opcode = IB_WR_REG_MR;
+	wr.wr.wr_cqe = &queue->bounce_reg_cqe;
+	wr.wr.send_flags = IB_SEND_SIGNALED;
+	wr.mr = mr;
+	wr.key = mr->rkey;
+	wr.access = IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_WRITE;
+
+	return ib_post_send(queue->qp, &wr.wr, &bad_wr);
 }
 
 static int nvme_rdma_conn_established(struct nvme_rdma_queue *queue)
@@ -1399,6 +2427,10 @@ static int nvme_rdma_conn_established(struct nvme_rdma_queue *queue)
 			goto out_destroy_queue_ib;
 	}
 
+	ret = nvme_rdma_reg_bounce(queue);
+	if (ret)
+		goto out_destroy_queue_ib;
+
 	return 0;
 
 out_destroy_queue_ib:
@@ -1607,6 +2639,33 @@ nvme_rdma_queue_is_ready(struct nvme_rdma_queue *queue, struct request *rq)
 	return 0;
 }
 
+/*
+ * Pick the RDMA queue a request is sent on.  Writes go to the write queue
+ * paired with the hctx if there is one, and Connect commands go to the
+ * queue they are connecting.
+ */
+static inline struct nvme_rdma_queue *
+nvme_rdma_select_queue(struct nvme_rdma_queue *queue, struct request *rq)
+{
+	struct nvme_rdma_ctrl *ctrl = queue->ctrl;
+	int idx = nvme_rdma_queue_idx(queue);
+
+	if (!idx || !ctrl->nr_write_queues)
+		return queue;
+
+	if (unlikely(blk_rq_is_passthrough(rq))) {
+		struct nvme_command *cmd = nvme_req(rq)->cmd;
+
+		if (cmd->common.opcode == nvme_fabrics_command &&
+		    cmd->fabrics.fctype == nvme_fabrics_type_connect)
+			return &ctrl->queues[le16_to_cpu(cmd->connect.qid)];
+	}
+
+	if (rq_data_dir(rq) == WRITE && idx <= ctrl->nr_write_queues)
+		return &ctrl->queues[nvme_rdma_nr_hw_queues(ctrl) + idx];
+	return queue;
+}
+
 static blk_status_t nvme_rdma_queue_rq(struct blk_mq_hw_ctx *hctx,
 		const struct blk_mq_queue_data *bd)
 {
@@ -1623,9 +2682,15 @@ static blk_status_t nvme_rdma_queue_rq(struct blk_mq_hw_ctx *hctx,
 
 	WARN_ON_ONCE(rq->tag < 0);
 
+	queue = nvme_rdma_select_queue(queue, rq);
+	req->queue = queue;
+
 	ret = nvme_rdma_queue_is_ready(queue, rq);
-	if (unlikely(ret))
+	if (unlikely(ret)) {
+		if (ret == BLK_STS_RESOURCE)
+			nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_BUSY);
 		return ret;
+	}
 
 	dev = queue->device->dev;
 	ib_dma_sync_single_for_cpu(dev, sqe->dma,
@@ -1659,29 +2724,23 @@ static blk_status_t nvme_rdma_queue_rq(struct blk_mq_hw_ctx *hctx,
 
 	return BLK_STS_OK;
 err:
-	if (err == -ENOMEM || err == -EAGAIN)
+	if (err == -ENOMEM || err == -EAGAIN) {
+		nvme_rdma_stat_inc(queue, NVME_RDMA_STAT_BUSY);
 		return BLK_STS_RESOURCE;
+	}
 	return BLK_STS_IOERR;
 }
 
 static int nvme_rdma_poll(struct blk_mq_hw_ctx *hctx, unsigned int tag)
 {
 	struct nvme_rdma_queue *queue = hctx->driver_data;
-	struct ib_cq *cq = queue->ib_cq;
-	struct ib_wc wc;
 	int found = 0;
 
-	while (ib_poll_cq(cq, 1, &wc) > 0) {
-		struct ib_cqe *cqe = wc.wr_cqe;
-
-		if (cqe) {
-			if (cqe->done == nvme_rdma_recv_done)
-				found |= __nvme_rdma_recv_done(cq, &wc, tag);
-			else
-				cqe->done(cq, &wc);
-		}
-	}
-
+	/* whoever holds the CQ reaps it, including our completion */
+	if (!spin_trylock_bh(&queue->cq->lock))
+		return 0;
+	nvme_rdma_process_cq(queue->cq, INT_MAX, queue, tag, &found);
+	spin_unlock_bh(&queue->cq->lock);
 	return found;
 }
 
@@ -1714,6 +2773,71 @@ static const struct blk_mq_ops nvme_rdma_admin_mq_ops = {
 	.timeout	= nvme_rdma_timeout,
 };
 
+static int nvme_rdma_stats_show(struct seq_file *m, void *unused)
+{
+	struct nvme_rdma_ctrl *ctrl = m->private;
+	int i, j, cpu;
+
+	for (i = 0; i < ctrl->ctrl.queue_count; i++) {
+		struct nvme_rdma_queue *queue = &ctrl->queues[i];
+		u64 sum[NVME_RDMA_STAT_NR] = { };
+
+		if (!queue->stats)
+			continue;
+
+		for_each_possible_cpu(cpu) {
+			struct nvme_rdma_queue_stats *stats =
+				per_cpu_ptr(queue->stats, cpu);
+
+			for (j = 0; j < NVME_RDMA_STAT_NR; j++)
+				sum[j] += stats->cnt[j];
+		}
+
+		seq_printf(m, "queue %d:", i);
+		for (j = 0; j < NVME_RDMA_STAT_NR; j++)
+			seq_printf(m, " %s %llu", nvme_rdma_stat_names[j],
+				   sum[j]);
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+static int nvme_rdma_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvme_rdma_stats_show, inode->i_private);
+}
+
+static const struct file_operations nvme_rdma_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nvme_rdma_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void nvme_rdma_debugfs_add(struct nvme_rdma_ctrl *ctrl)
+{
+	if (!nvme_rdma_debugfs_root)
+		return;
+
+	ctrl->debugfs_dir = debugfs_create_dir(dev_name(ctrl->ctrl.device),
+			nvme_rdma_debugfs_root);
+	if (IS_ERR_OR_NULL(ctrl->debugfs_dir)) {
+		ctrl->debugfs_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("queue_stats", 0400, ctrl->debugfs_dir, ctrl,
+			&nvme_rdma_stats_fops);
+}
+
+static void nvme_rdma_debugfs_remove(struct nvme_rdma_ctrl *ctrl)
+{
+	debugfs_remove_recursive(ctrl->debugfs_dir);
+	ctrl->debugfs_dir = NULL;
+}
+
 static void nvme_rdma_shutdown_ctrl(struct nvme_rdma_ctrl *ctrl, bool shutdown)
 {
 	cancel_work_sync(&ctrl->err_work);
@@ -1740,6 +2864,7 @@ static void nvme_rdma_shutdown_ctrl(struct nvme_rdma_ctrl *ctrl, bool shutdown)
 
 static void nvme_rdma_remove_ctrl(struct nvme_rdma_ctrl *ctrl)
 {
+	nvme_rdma_debugfs_remove(ctrl);
 	nvme_remove_namespaces(&ctrl->ctrl);
 	nvme_rdma_shutdown_ctrl(ctrl, true);
 	nvme_uninit_ctrl(&ctrl->ctrl);
@@ -1876,7 +3001,8 @@ static struct nvme_ctrl *nvme_rdma_create_ctrl(struct device *dev,
 	INIT_WORK(&ctrl->delete_work, nvme_rdma_del_ctrl_work);
 	INIT_WORK(&ctrl->ctrl.reset_work, nvme_rdma_reset_ctrl_work);
 
-	ctrl->ctrl.queue_count = opts->nr_io_queues + 1; /* +1 for admin queue */
+	/* +1 for admin queue */
+	ctrl->ctrl.queue_count = opts->nr_io_queues + opts->nr_write_queues + 1;
 	ctrl->ctrl.sqsize = opts->queue_size - 1;
 	ctrl->ctrl.kato = opts->kato;
 
@@ -1938,6 +3064,8 @@ static struct nvme_ctrl *nvme_rdma_create_ctrl(struct device *dev,
 	list_add_tail(&ctrl->list, &nvme_rdma_ctrl_list);
 	mutex_unlock(&nvme_rdma_ctrl_mutex);
 
+	nvme_rdma_debugfs_add(ctrl);
+
 	nvme_start_ctrl(&ctrl->ctrl);
 
 	return &ctrl->ctrl;
@@ -1945,7 +3073,7 @@ static struct nvme_ctrl *nvme_rdma_create_ctrl(struct device *dev,
 out_remove_admin_queue:
 	nvme_rdma_destroy_admin_queue(ctrl, true);
 out_kfree_queues:
-	kfree(ctrl->queues);
+	nvme_rdma_free_queues_mem(ctrl);
 out_uninit_ctrl:
 	nvme_uninit_ctrl(&ctrl->ctrl);
 	nvme_put_ctrl(&ctrl->ctrl);
@@ -1961,7 +3089,8 @@ static struct nvmf_transport_ops nvme_rdma_transport = {
 	.name		= "rdma",
 	.required_opts	= NVMF_OPT_TRADDR,
 	.allowed_opts	= NVMF_OPT_TRSVCID | NVMF_OPT_RECONNECT_DELAY |
-			  NVMF_OPT_HOST_TRADDR | NVMF_OPT_CTRL_LOSS_TMO,
+			  NVMF_OPT_HOST_TRADDR | NVMF_OPT_CTRL_LOSS_TMO |
+			  NVMF_OPT_NR_WRITE_QUEUES,
 	.create_ctrl	= nvme_rdma_create_ctrl,
 };
 
@@ -1998,9 +3127,16 @@ static int __init nvme_rdma_init_module(void)
 {
 	int ret;
 
+	small_read_size = min_t(unsigned int, small_read_size, PAGE_SIZE);
+
+	/* debugfs is optional, the statistics just won't be visible */
+	nvme_rdma_debugfs_root = debugfs_create_dir("nvme_rdma", NULL);
+	if (IS_ERR(nvme_rdma_debugfs_root))
+		nvme_rdma_debugfs_root = NULL;
+
 	ret = ib_register_client(&nvme_rdma_ib_client);
 	if (ret)
-		return ret;
+		goto err_remove_debugfs;
 
 	ret = nvmf_register_transport(&nvme_rdma_transport);
 	if (ret)
@@ -2010,6 +3146,8 @@ static int __init nvme_rdma_init_module(void)
 
 err_unreg_client:
 	ib_unregister_client(&nvme_rdma_ib_client);
+err_remove_debugfs:
+	debugfs_remove_recursive(nvme_rdma_debugfs_root);
 	return ret;
 }
 
@@ -2017,6 +3155,7 @@ static void __exit nvme_rdma_cleanup_module(void)
 {
 	nvmf_unregister_transport(&nvme_rdma_transport);
 	ib_unregister_client(&nvme_rdma_ib_client);
+	debugfs_remove_recursive(nvme_rdma_debugfs_root);
 }
 
 module_init(nvme_rdma_init_module);
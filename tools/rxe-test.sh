@@ -0,0 +1,394 @@
+#!/bin/bash
+#
+# End-to-end test and benchmark of the NVMe over RDMA host on Soft-RoCE.
+#
+# Sets up two rdma_rxe links on dummy interfaces, exports a memory backed
+# null_blk device through an nvmet-rdma target listening on both, connects
+# the host modules built from this tree to it and runs:
+#
+#   connect	connect, data integrity check, disconnect
+#   reconnect	take the link down under I/O and bring it back
+#   failover	connect both paths and take one down under I/O (needs a
+#		shared namespace, i.e. an mpnvme device)
+#   bench	fio throughput and latency, and signaled sends per I/O, if
+#		fio is installed
+#
+# Usage: tools/rxe-test.sh [-m moddir] [-t seconds] [test...]
+#
+# moddir holds nvme-core.ko, nvme-fabrics.ko and nvme-rdma.ko, by default
+# the build directory of the running kernel.  Must be run as root on a
+# scratch machine, it unloads and reloads the nvme modules.
+#
+
+NQN=nqn.2017-01.io.nvmeof:rxe-test
+PORT=4420
+ADDR=(10.99.0.1 10.99.1.1)
+NETDEV=(nvrxe0 nvrxe1)
+CFS=/sys/kernel/config/nvmet
+NULLB=/sys/kernel/config/nullb/rxe-test
+MODDIR=$(dirname "$0")/../$(uname -r)/$(uname -m)
+RUNTIME=10
+FAILED=0
+CTRLS=()
+
+usage()
+{
+	sed -n '3,20s/^# \{0,1\}//p' "$0"
+	exit 1
+}
+
+log()
+{
+	echo "rxe-test: $*"
+}
+
+fail()
+{
+	log "FAIL: $*"
+	FAILED=$((FAILED + 1))
+}
+
+load_host_modules()
+{
+	local m
+
+	for m in nvme_rdma nvme_fabrics nvme nvme_core; do
+		rmmod $m 2>/dev/null
+	done
+	for m in nvme-core nvme-fabrics nvme-rdma; do
+		insmod "$MODDIR/$m.ko" || return 1
+	done
+}
+
+setup_rxe()
+{
+	local i
+
+	modprobe rdma_rxe || return 1
+	modprobe dummy || return 1
+	for i in 0 1; do
+		ip link add "${NETDEV[$i]}" type dummy || return 1
+		ip addr add "${ADDR[$i]}/24" dev "${NETDEV[$i]}" || return 1
+		ip link set "${NETDEV[$i]}" up || return 1
+		if ! rdma link add "rxe_${NETDEV[$i]}" type rxe \
+				netdev "${NETDEV[$i]}" 2>/dev/null; then
+			# rdma tool too old, fall back to the module parameter
+			echo "${NETDEV[$i]}" > /sys/module/rdma_rxe/parameters/add ||
+				return 1
+		fi
+	done
+}
+
+setup_target()
+{
+	local i ns=$CFS/subsystems/$NQN/namespaces/1
+
+	# memory backed, so that data can be verified
+	modprobe null_blk nr_devices=0 || return 1
+	mkdir $NULLB || return 1
+	echo 1024 > $NULLB/size
+	echo 1 > $NULLB/memory_backed || return 1
+	echo 1 > $NULLB/power || return 1
+
+	modprobe nvmet-rdma || return 1
+
+	mkdir "$CFS/subsystems/$NQN" || return 1
+	echo 1 > "$CFS/subsystems/$NQN/attr_allow_any_host"
+	mkdir "$ns"
+	echo "/dev/nullb$(cat $NULLB/index)" > "$ns/device_path"
+	echo 1 > "$ns/enable" || return 1
+
+	for i in 0 1; do
+		mkdir "$CFS/ports/$((i + 1))"
+		echo rdma > "$CFS/ports/$((i + 1))/addr_trtype"
+		echo ipv4 > "$CFS/ports/$((i + 1))/addr_adrfam"
+		echo "${ADDR[$i]}" > "$CFS/ports/$((i + 1))/addr_traddr"
+		echo $PORT > "$CFS/ports/$((i + 1))/addr_trsvcid"
+		ln -s "$CFS/subsystems/$NQN" \
+			"$CFS/ports/$((i + 1))/subsystems/$NQN" || return 1
+	done
+}
+
+# nvmet keeps established controllers when a port loses its subsystem, so
+# take paths down at the transport: rxe drops the traffic of a down netdev
+# and the host's QPs fail their retries.
+path_up()
+{
+	ip link set "${NETDEV[$1]}" up
+}
+
+path_down()
+{
+	ip link set "${NETDEV[$1]}" down
+}
+
+# connect <path> [extra options], prints the controller name
+connect()
+{
+	local opts="transport=rdma,traddr=${ADDR[$1]},trsvcid=$PORT,nqn=$NQN"
+	local reply
+
+	opts="$opts,reconnect_delay=1,ctrl_loss_tmo=30${2:+,$2}"
+	exec 3<>/dev/nvme-fabrics || return 1
+	echo "$opts" >&3 || { exec 3>&-; return 1; }
+	read -r reply <&3
+	exec 3>&-
+
+	reply=${reply#instance=}
+	echo "nvme${reply%%,*}"
+}
+
+disconnect()
+{
+	echo 1 > "/sys/class/nvme/$1/delete_controller" 2>/dev/null
+}
+
+# wait_state <ctrl> <state> <seconds>
+wait_state()
+{
+	local i
+
+	for ((i = 0; i < $3 * 10; i++)); do
+		[ "$(cat "/sys/class/nvme/$1/state" 2>/dev/null)" = "$2" ] &&
+			return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+# wait_dev <pattern>, prints the first block device matching it
+wait_dev()
+{
+	local i dev
+
+	for ((i = 0; i < 100; i++)); do
+		for dev in /dev/$1; do
+			[ -b "$dev" ] && { echo "$dev"; return 0; }
+		done
+		sleep 0.1
+	done
+	return 1
+}
+
+# verify <dev>: write a random pattern and read it back
+verify()
+{
+	local pat=/tmp/rxe-test.pat
+
+	dd if=/dev/urandom of=$pat bs=1M count=16 2>/dev/null
+	dd if=$pat of="$1" bs=1M oflag=direct 2>/dev/null || return 1
+	dd if="$1" bs=1M count=16 iflag=direct 2>/dev/null | cmp -s - $pat
+}
+
+# io_load <dev> <seconds>: mixed direct I/O, fails on the first I/O error
+io_load()
+{
+	local end=$((SECONDS + $2))
+
+	while [ $SECONDS -lt $end ]; do
+		dd if=/dev/zero of="$1" bs=4k count=4096 oflag=direct \
+			2>/dev/null || return 1
+		dd if="$1" of=/dev/null bs=64k count=1024 iflag=direct \
+			2>/dev/null || return 1
+	done
+}
+
+dump_stats()
+{
+	local f
+
+	for f in /sys/kernel/debug/nvme_rdma/"$1"/*; do
+		[ -f "$f" ] || continue
+		log "$(basename "$f") of $1:"
+		sed 's/^/    /' "$f"
+	done
+}
+
+test_connect()
+{
+	local ctrl dev
+
+	ctrl=$(connect 0) || { fail "connect"; return; }
+	CTRLS+=("$ctrl")
+	wait_state "$ctrl" live 10 || fail "$ctrl did not go live"
+	dev=$(wait_dev "${ctrl}n1") || { fail "no namespace on $ctrl"; return; }
+	verify "$dev" || fail "data mismatch on $dev"
+	dump_stats "$ctrl"
+	disconnect "$ctrl"
+	log "connect: done"
+}
+
+test_reconnect()
+{
+	local ctrl dev pid
+
+	ctrl=$(connect 0) || { fail "connect"; return; }
+	CTRLS+=("$ctrl")
+	dev=$(wait_dev "${ctrl}n1") || { fail "no namespace on $ctrl"; return; }
+	io_load "$dev" "$RUNTIME" &
+	pid=$!
+
+	sleep 1
+	path_down 0
+	wait_state "$ctrl" reconnecting 30 ||
+		fail "$ctrl did not start reconnecting"
+	sleep 2
+	path_up 0
+	wait_state "$ctrl" live 30 || fail "$ctrl did not reconnect"
+	wait "$pid" || fail "I/O failed across the reconnect"
+
+	verify "$dev" || fail "data mismatch on $dev after reconnect"
+	dump_stats "$ctrl"
+	disconnect "$ctrl"
+	log "reconnect: done"
+}
+
+test_failover()
+{
+	local c0 c1 dev pid
+
+	c0=$(connect 0) || { fail "connect path 0"; return; }
+	CTRLS+=("$c0")
+	c1=$(connect 1) || { fail "connect path 1"; return; }
+	CTRLS+=("$c1")
+	if ! dev=$(wait_dev "mpnvme*n1"); then
+		log "failover: no shared namespace, skipped"
+		disconnect "$c1"
+		disconnect "$c0"
+		return
+	fi
+
+	io_load "$dev" "$RUNTIME" &
+	pid=$!
+	sleep 1
+	path_down 0
+	wait "$pid" || fail "I/O failed while path 0 was down"
+	verify "$dev" || fail "data mismatch on $dev with path 0 down"
+	path_up 0
+	wait_state "$c0" live 30 || fail "$c0 did not come back"
+
+	io_load "$dev" "$RUNTIME" &
+	pid=$!
+	sleep 1
+	path_down 1
+	wait "$pid" || fail "I/O failed while path 1 was down"
+	path_up 1
+	wait_state "$c1" live 30 || fail "$c1 did not come back"
+	verify "$dev" || fail "data mismatch on $dev after failback"
+
+	disconnect "$c1"
+	disconnect "$c0"
+	log "failover: done"
+}
+
+# io_stat <ctrl> <counter>: sum of a queue_stats counter over the I/O queues
+io_stat()
+{
+	awk -v k="$2" '$1 == "queue" && $2 != "0:" {
+		for (i = 3; i < NF; i += 2)
+			if ($i == k)
+				sum += $(i + 1)
+	} END { print sum + 0 }' "/sys/kernel/debug/nvme_rdma/$1/queue_stats"
+}
+
+# dev_ios <dev>: reads and writes completed by a block device
+dev_ios()
+{
+	awk '{ print $1 + $5 }' "/sys/block/$(basename "$1")/stat"
+}
+
+# run_fio <ctrl> <dev> <rw> <iodepth> <jobs>: one fio run, prints IOPS,
+# mean completion latency and signaled sends per I/O
+run_fio()
+{
+	local sig ios
+
+	sig=$(io_stat "$1" send_signaled)
+	ios=$(dev_ios "$2")
+	fio --name=bench --filename="$2" --direct=1 --ioengine=libaio \
+		--rw="$3" --bs=4k --iodepth="$4" --numjobs="$5" \
+		--group_reporting --time_based --runtime="$RUNTIME" \
+		--output-format=terse --terse-version=3 | awk -F';' '{
+			printf "    read %s IOPS clat %s us, " \
+				"write %s IOPS clat %s us\n",
+				$8, $16, $49, $57 }'
+	sig=$(($(io_stat "$1" send_signaled) - sig))
+	ios=$(($(dev_ios "$2") - ios))
+	awk -v s="$sig" -v n="$ios" 'BEGIN {
+		printf "    %d signaled sends / %d I/Os = %.3f per I/O\n",
+			s, n, n ? s / n : 0 }'
+}
+
+test_bench()
+{
+	local ctrl dev rw
+
+	if ! command -v fio >/dev/null; then
+		log "bench: fio not installed, skipped"
+		return
+	fi
+
+	ctrl=$(connect 0 "nr_io_queues=$(nproc)") || { fail "connect"; return; }
+	CTRLS+=("$ctrl")
+	dev=$(wait_dev "${ctrl}n1") || { fail "no namespace on $ctrl"; return; }
+
+	for rw in randread randwrite; do
+		log "bench: 4k $rw, QD 1 (latency)"
+		run_fio "$ctrl" "$dev" $rw 1 1
+		log "bench: 4k $rw, QD 32 x $(nproc) jobs (throughput)"
+		run_fio "$ctrl" "$dev" $rw 32 "$(nproc)"
+	done
+	dump_stats "$ctrl"
+	disconnect "$ctrl"
+}
+
+cleanup()
+{
+	local c i
+
+	for c in "${CTRLS[@]}"; do
+		disconnect "$c"
+	done
+	for i in 0 1; do
+		rm -f "$CFS/ports/$((i + 1))/subsystems/$NQN"
+		rmdir "$CFS/ports/$((i + 1))" 2>/dev/null
+	done
+	echo 0 > "$CFS/subsystems/$NQN/namespaces/1/enable" 2>/dev/null
+	rmdir "$CFS/subsystems/$NQN/namespaces/1" 2>/dev/null
+	rmdir "$CFS/subsystems/$NQN" 2>/dev/null
+	rmmod nvmet_rdma nvmet 2>/dev/null
+	echo 0 > $NULLB/power 2>/dev/null
+	rmdir $NULLB 2>/dev/null
+	rmmod null_blk 2>/dev/null
+	for i in 0 1; do
+		rdma link delete "rxe_${NETDEV[$i]}" 2>/dev/null ||
+			echo "rxe_${NETDEV[$i]}" > \
+				/sys/module/rdma_rxe/parameters/remove 2>/dev/null
+		ip link delete "${NETDEV[$i]}" 2>/dev/null
+	done
+}
+
+while getopts "m:t:h" opt; do
+	case $opt in
+	m) MODDIR=$OPTARG ;;
+	t) RUNTIME=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+TESTS=${*:-connect reconnect failover bench}
+
+[ "$(id -u)" = 0 ] || { log "must be run as root"; exit 1; }
+
+trap cleanup EXIT
+load_host_modules || { log "failed to load modules from $MODDIR"; exit 1; }
+setup_rxe || { log "failed to set up rxe"; exit 1; }
+setup_target || { log "failed to set up the nvmet target"; exit 1; }
+
+for t in $TESTS; do
+	log "running $t"
+	"test_$t"
+done
+
+[ $FAILED = 0 ] && log "all tests passed" || log "$FAILED failure(s)"
+exit $((FAILED != 0))